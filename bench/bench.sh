@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# 在同一组脚本上比较若干解释器/编译目标的运行时间
+#
+# ./bench/bench.sh [-n 次数] [命令 ...]
+#
+# 每个命令是一个解释器及其参数, 例如 "./z --stack" "./z --register";
+# 默认比较当前构建的栈式和寄存器形式两种编译目标.
+# 每个脚本运行若干次取最短时间.
+
+cd "$(dirname "$0")/.." || exit 1
+
+runs=3
+if [ "$1" = "-n" ]; then
+    runs=$2
+    shift 2
+fi
+
+if [ $# -eq 0 ]; then
+    set -- "./z --stack" "./z --register"
+fi
+
+printf "%-16s" "script"
+for command in "$@"; do printf "%20s" "$command"; done
+printf "\n"
+
+for script in bench/*.lox; do
+    printf "%-16s" "$(basename "$script" .lox)"
+    for command in "$@"; do
+        best=""
+        for ((i = 0; i < runs; i++)); do
+            start=$(date +%s%N)
+            $command "$script" >/dev/null || exit 1
+            end=$(date +%s%N)
+            time=$(((end - start) / 1000000))
+            if [ -z "$best" ] || [ "$time" -lt "$best" ]; then
+                best=$time
+            fi
+        done
+        printf "%18dms" "$best"
+    done
+    printf "\n"
+done
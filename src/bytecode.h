@@ -9,20 +9,27 @@ typedef enum {
     OP_TRUE,    // 类似上
     OP_FALSE,   // 类似上
     OP_POP,     // 弹出栈顶
-    // (全局)变量名存在常量池中,
-    // 下面三个命令的arg即为其索引,
-    // 其值存储在global哈希表中
-    OP_DEFINE_GLOBAL, // op arg, 取出栈顶元素作为变量名的value放入global
-    OP_GET_GLOBAL, // op arg, 取出变量名的value放入栈中
-    OP_SET_GLOBAL, // op arg, 将栈顶元素作为变量名在global中的value
+    // 全局变量在编译时分配槽位(globalSlot), 下面三个命令的slot16是
+    // vm.globalValues的下标, 变量名在vm.globalNames的同一下标处;
+    // 声明过但还没有定义的槽位的值是UNDEFINED_VAL
+    OP_DEFINE_GLOBAL, // op slot16, 取出栈顶元素放入全局变量数组的slot处
+    OP_GET_GLOBAL, // op slot16, 取出全局变量的值放入栈中
+    OP_SET_GLOBAL, // op slot16, 将栈顶元素作为全局变量的值
     // 而局部变量直接存在栈中, 下面的arg是栈的地址
     OP_GET_LOCAL,   // op arg, 取出栈arg位置的值入栈
     OP_SET_LOCAL,   // op_arg, 直接修改arg位置的值
     OP_GET_UPVALUE, // 同上, 参数为upvalue在上值列表的索引
     OP_SET_UPVALUE,
+    // 消除捕获后的上值访问, 参数为调用者(定义该函数的那一帧)的栈槽
+    OP_GET_OUTER,
+    OP_SET_OUTER,
+    OP_SKIP, // op n (n个字节), 跳过消除捕获后留下的上值描述
     OP_EQUAL, // equal: 取出栈顶两个元素进行比较, 并将结构压入栈中
     OP_GREATER,       // greater >:
     OP_LESS,          // less <:
+    OP_NOT_EQUAL,     // not equal !=:
+    OP_GREATER_EQUAL, // greater equal >=:
+    OP_LESS_EQUAL,    // less equal <=:
     OP_ADD,           // add +:
     OP_SUBTRACT,      // subtract 中缀-:
     OP_MULTIPLY,      // multiply *:
@@ -32,28 +39,77 @@ typedef enum {
     OP_PRINT,         // op, "取出"栈顶元素并打印
     OP_JUMP,          // jump
     OP_JUMP_IF_FALSE, // 条件jump
+    OP_POP_JUMP_IF_FALSE,  // 条件出栈, 为假则jump, 用于if/while/for
+    OP_JUMP_IF_FALSE_OR_POP, // 为假则保留条件并jump, 否则出栈, 用于and
+    OP_JUMP_IF_TRUE_OR_POP,  // 为真则保留条件并jump, 否则出栈, 用于or
     OP_CALL,          // 函数调用
+    OP_TAIL_CALL,     // 尾调用 return f(...), 复用当前的CallFrame
     OP_LOOP,          //
     OP_CLOSE_UPVALUE, // 对于函数中被其他闭包捕获的变量的处理
     OP_RETURN,        // return
     OP_CLASS,
-    OP_GET_PROPERTY, // class get
-    OP_SET_PROPERTY, // class set
-    OP_METHOD,
-    OP_INVOKE, // 针对直接调用方法, 两个参数,
-               // 属性名在常量表的索引和传递给方法的参数数量
+    OP_GET_PROPERTY, // op name cache16: class get, cache是函数内联缓存的索引
+    OP_SET_PROPERTY, // op name cache16: class set
+    // 方法名在编译时解析成选择子(selector16), 即类的方法表的下标
+    OP_METHOD, // op selector16
+    OP_INVOKE, // op selector16 argc cache16: 针对直接调用方法,
+               // argc是传递给方法的参数数量
     OP_INHERIT,   // 继承
-    OP_GET_SUPER, // 超类访问
+    OP_GET_SUPER, // op selector16: 超类访问
+    OP_SUPER_INVOKE, // op selector16 argc cache16: super.name(...),
+                     // 不创建绑定方法
 
     OP_BUILD_LIST,
     OP_INDEX_SUBSCR,
     OP_STORE_SUBSCR,
+    // op a offset: 栈槽a, a+1, a+2是迭代器(容器, 游标, 循环变量),
+    // 取出下一个元素放入循环变量, 没有更多元素则跳转offset
+    OP_FOR_ITER,
+
+    // 超级指令(superinstruction): 编译器窥孔优化把常见的指令序列合并成一条,
+    // 后缀L表示操作数是局部变量的栈槽, C表示操作数是常量池索引
+    OP_ADD_LL,        // op a b: GET_LOCAL a; GET_LOCAL b; ADD
+    OP_ADD_LC,        // op a k: GET_LOCAL a; CONSTANT k; ADD
+    OP_SUBTRACT_LL,   // 类似上
+    OP_SUBTRACT_LC,   // 类似上
+    OP_SET_LOCAL_POP, // op a: SET_LOCAL a; POP
+
+    // 比较并跳转: 比较 + POP_JUMP_IF_FALSE, 两个操作数出栈, 比较不成立时跳转
+    OP_JUMP_IF_NOT_LESS,          // LESS; POP_JUMP_IF_FALSE
+    OP_JUMP_IF_NOT_LESS_EQUAL,    // LESS_EQUAL; POP_JUMP_IF_FALSE
+    OP_JUMP_IF_NOT_GREATER,       // GREATER; POP_JUMP_IF_FALSE
+    OP_JUMP_IF_NOT_GREATER_EQUAL, // GREATER_EQUAL; POP_JUMP_IF_FALSE
+    OP_JUMP_IF_NOT_EQUAL,         // EQUAL; POP_JUMP_IF_FALSE
+    OP_JUMP_IF_EQUAL,             // NOT_EQUAL; POP_JUMP_IF_FALSE
+
+    // 计数循环 for (var i = ...; i < n; i = i + k) 循环体末尾的指令:
+    // op i n k offset: i = i + k; 如果 i < n, 向回跳转offset
+    OP_FOR_LOOP,   // n是局部变量的栈槽
+    OP_FOR_LOOP_K, // n是常量池索引
+
+    // 寄存器形式(三地址)指令: 操作数直接是当前帧的栈槽(frame->slots),
+    // 不经过栈顶; 由编译器在寄存器形式的编译目标下为局部变量的赋值语句生成,
+    // 后缀R表示栈槽, K表示常量池索引, 第一个操作数是目的栈槽
+    OP_MOVE,         // op a b: a = b
+    OP_LOADK,        // op a k: a = k
+    OP_ADD_RRR,      // op a b c: a = b + c
+    OP_ADD_RRK,      // op a b k: a = b + k
+    OP_SUBTRACT_RRR, // 类似上
+    OP_SUBTRACT_RRK, //
+    OP_MULTIPLY_RRR, //
+    OP_MULTIPLY_RRK, //
+    OP_DIVIDE_RRR,   //
+    OP_DIVIDE_RRK,   //
+
+    // 快速化(quickening)指令: 由虚拟机在执行时原地改写通用指令得到,
+    // 编译器不会直接生成, 类型守卫失败时改写回通用指令
+    OP_ADD_NUM,      // OP_ADD, 两个操作数都是数字
+    OP_ADD_STR,      // OP_ADD, 两个操作数都是字符串
+    OP_CALL_CLOSURE, // OP_CALL, 被调用者是闭包
+    OP_GET_FIELD,    // OP_GET_PROPERTY, 属性是实例的字段
 } OpCode; // operation code
 
-// 并没有<=、>=、!=
-//  因为 !(a < b) -> (a >= b)
-//      !(a > b) -> (a <= b)
-//      !(a == b) -> (a != b)
-//  有一个例外, 就是数字Nan, 在C中它和任何数字比较都是false
+// <=、>=、!=有自己的指令, 而不是 !(a > b)、!(a < b)、!(a == b),
+// 因为数字NaN和任何数字比较都是false, 例如NaN <= 1和!(NaN > 1)结果不同
 
 #endif
\ No newline at end of file
@@ -42,4 +42,90 @@ int addConstant(Chunk* Chunk, Value value) {
     writeValueArray(&Chunk->constants, value);
     pop();
     return Chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+    // 指令的总字节数(操作码+操作数), 编译器的窥孔优化靠它找到指令边界
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_OUTER:
+        case OP_SET_OUTER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_BUILD_LIST:
+        case OP_SET_LOCAL_POP:
+        case OP_CALL_CLOSURE: return 2;
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_OR_POP:
+        case OP_JUMP_IF_TRUE_OR_POP:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+        case OP_LOOP:
+        case OP_ADD_LL:
+        case OP_ADD_LC:
+        case OP_SUBTRACT_LL:
+        case OP_SUBTRACT_LC:
+        case OP_MOVE:
+        case OP_LOADK: return 3;
+        case OP_ADD_RRR:
+        case OP_ADD_RRK:
+        case OP_SUBTRACT_RRR:
+        case OP_SUBTRACT_RRK:
+        case OP_MULTIPLY_RRR:
+        case OP_MULTIPLY_RRK:
+        case OP_DIVIDE_RRR:
+        case OP_DIVIDE_RRK: return 4;
+        case OP_FOR_ITER:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_FIELD: return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE: return 6;
+        case OP_FOR_LOOP:
+        case OP_FOR_LOOP_K: return 6;
+        case OP_CLOSURE: {
+            // 还没写入常量索引时, 至少还有一个字节
+            if (offset + 1 >= chunk->count) return 2;
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        case OP_SKIP:
+            if (offset + 1 >= chunk->count) return 2;
+            return 2 + chunk->code[offset + 1];
+        default: return 1;
+    }
+}
+bool transfersControl(uint8_t opcode) {
+    // 无条件转移控制(跳转, 调用, 返回)的指令, 后面的指令不是紧接着它执行的,
+    // 窥孔优化不和后面的指令合并, superinstructions.sh也不报告这样的指令对.
+    // 新增这类指令时只需加在这里
+    switch (opcode) {
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_SKIP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_RETURN: return true;
+        default: return false;
+    }
+}
@@ -20,5 +20,7 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int instructionLength(Chunk* chunk, int offset);
+bool transfersControl(uint8_t opcode);
 
 #endif
\ No newline at end of file
@@ -10,6 +10,23 @@
 // #define DEBUG_TRACE_EXECUTION // debug_trace_execution
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_PROFILE_OPCODES // 统计opcode pair, 见superinstructions.sh
+// #define DEBUG_PROFILE_CACHES  // 统计内联缓存的命中率, 退出时输出
+// #define NAN_BOXING            // Value用NaN boxing压缩成8字节, 见value.h
+
+// 虚拟机指令分派方式: 支持GCC扩展labels as values的编译器使用线程化分派
+// (computed goto), 否则(或定义了NO_COMPUTED_GOTO)回退到switch
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// 栈顶缓存(TOS_CACHE, 见vm.c run())默认关闭, 它依赖线程化分派;
+// 跟踪执行时打印栈需要完整的栈, 所以也不能开启
+#if defined(TOS_CACHE) \
+    && (!defined(COMPUTED_GOTO) || defined(DEBUG_TRACE_EXECUTION))
+#undef TOS_CACHE
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
\ No newline at end of file
@@ -46,6 +46,12 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured; // 是否被底层代码块捕获成闭包中的值
+    bool isAssigned; // 是否被赋值过, 计数循环用来确认循环体没有修改计数器
+    int captures;    // 直接捕获它的闭包数量, 消除捕获后会减少
+    // 逃逸分析: 局部函数声明生成的OP_CLOSURE的偏移(不是候选时为-1),
+    // 以及它除了直接调用之外是否还有别的用法
+    int closure;
+    bool escapes;
 } Local;
 
 typedef struct {
@@ -61,6 +67,8 @@ typedef enum {
                       // 那么它就是特殊的method
 } FunctionType;
 
+#define RECENT_COUNT 4
+
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
@@ -69,6 +77,15 @@ typedef struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    // 窥孔优化: 最近几条完整指令的起始偏移(recent[0]是最后一条),
+    // 已解码到的偏移, 以及最近一个跳转目标的偏移,
+    // 合并超级指令时不能跨越跳转目标
+    int recent[RECENT_COUNT];
+    int decoded;
+    int jumpTarget;
+    bool upvaluesCaptured;   // 内层函数通过本函数的上值捕获了变量
+    bool callsLocalFunction; // 直接调用过候选的局部函数, 之后不再生成尾调用
+    int eliminatedCaptures;  // 消除的捕获数量, DEBUG_PRINT_CODE时报告
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -81,6 +98,12 @@ Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 Chunk* compilingChunk;
+// 局部变量的赋值语句是否编译成寄存器形式的三地址指令
+#ifdef NO_REGISTER_FORM
+static bool registerForm = false;
+#else
+static bool registerForm = true;
+#endif
 
 static Chunk* currentChunk() {
     return &current->function->chunk;
@@ -92,6 +115,12 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    for (int i = 0; i < RECENT_COUNT; i++) compiler->recent[i] = -1;
+    compiler->decoded = 0;
+    compiler->jumpTarget = 0;
+    compiler->upvaluesCaptured = false;
+    compiler->callsLocalFunction = false;
+    compiler->eliminatedCaptures = 0;
 
     compiler->function = newFunction();
     current = compiler;
@@ -103,6 +132,10 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->captures = 0;
+    local->closure = -1;
+    local->escapes = false;
     local->name.start = "";
     local->name.length = 0;
 
@@ -173,7 +206,166 @@ static bool match(TokenType type) {
 
 // ===
 
+static void trackInstructions() {
+    // 解码新写入的字节, 记录最近几条完整指令的起始偏移
+    Chunk* chunk = currentChunk();
+    while (current->decoded < chunk->count) {
+        int length = instructionLength(chunk, current->decoded);
+        if (current->decoded + length > chunk->count) return; // 还没写完
+        for (int i = RECENT_COUNT - 1; i > 0; i--) {
+            current->recent[i] = current->recent[i - 1];
+        }
+        current->recent[0] = current->decoded;
+        current->decoded += length;
+    }
+}
+
+static bool isFusable(int n) {
+    // 最近n条指令都已记录, 不会有跳转落在它们中间,
+    // 并且除了最后一条都不转移控制(见transfersControl)
+    if (current->recent[n - 1] < 0
+        || current->recent[n - 1] < current->jumpTarget) {
+        return false;
+    }
+    for (int i = 1; i < n; i++) {
+        if (transfersControl(currentChunk()->code[current->recent[i]])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint8_t recentOp(int i) {
+    return currentChunk()->code[current->recent[i]];
+}
+
+static uint8_t recentArg(int i, int n) {
+    return currentChunk()->code[current->recent[i] + n];
+}
+
+static void replaceRecent(int n, uint8_t op, uint8_t a, uint8_t b, uint8_t c,
+                          int length) {
+    // 用一条指令替换最近n条指令, 替换后的指令可以继续参与合并
+    Chunk* chunk = currentChunk();
+    int start = current->recent[n - 1];
+    uint8_t bytes[4] = {op, a, b, c};
+    for (int i = 0; i < length; i++) chunk->code[start + i] = bytes[i];
+    chunk->count = start + length;
+
+    for (int i = 0; i < RECENT_COUNT; i++) {
+        current->recent[i] = i + n < RECENT_COUNT ? current->recent[i + n] : -1;
+    }
+    current->decoded = start;
+    trackInstructions();
+}
+
+static bool fuseRegisterForm() {
+    // 局部变量的赋值语句 a = b; a = k; a = b op c; a = b op k;
+    // 编译成直接读写栈槽的三地址指令, 整条语句只需一次分派
+    if (!isFusable(2) || recentOp(0) != OP_SET_LOCAL) return false;
+    uint8_t a = recentArg(0, 1);
+    uint8_t op = recentOp(1);
+
+    switch (op) {
+        case OP_GET_LOCAL:
+            replaceRecent(2, OP_MOVE, a, recentArg(1, 1), 0, 3);
+            return true;
+        case OP_CONSTANT:
+            replaceRecent(2, OP_LOADK, a, recentArg(1, 1), 0, 3);
+            return true;
+        case OP_ADD_LL:
+        case OP_ADD_LC:
+        case OP_SUBTRACT_LL:
+        case OP_SUBTRACT_LC: {
+            static const uint8_t registerOps[] = {
+                [OP_ADD_LL] = OP_ADD_RRR,
+                [OP_ADD_LC] = OP_ADD_RRK,
+                [OP_SUBTRACT_LL] = OP_SUBTRACT_RRR,
+                [OP_SUBTRACT_LC] = OP_SUBTRACT_RRK,
+            };
+            replaceRecent(2, registerOps[op], a, recentArg(1, 1),
+                          recentArg(1, 2), 4);
+            return true;
+        }
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            if (!isFusable(4) || recentOp(3) != OP_GET_LOCAL) return false;
+            uint8_t fused;
+            if (recentOp(2) == OP_GET_LOCAL) {
+                fused = op == OP_MULTIPLY ? OP_MULTIPLY_RRR : OP_DIVIDE_RRR;
+            } else if (recentOp(2) == OP_CONSTANT) {
+                fused = op == OP_MULTIPLY ? OP_MULTIPLY_RRK : OP_DIVIDE_RRK;
+            } else {
+                return false;
+            }
+            replaceRecent(4, fused, a, recentArg(3, 1), recentArg(2, 1), 4);
+            return true;
+        }
+        default: return false;
+    }
+}
+
+static bool fuseInstruction(uint8_t instruction) {
+    // 超级指令: 把热点循环中常见的指令序列合并成一条, 减少分派次数,
+    // 候选序列来自opcode pair的统计(见superinstructions.sh)
+    trackInstructions();
+    // 正在写入的是上一条指令的操作数
+    if (current->decoded != currentChunk()->count) return false;
+
+    if (instruction == OP_POP) {
+        if (registerForm && fuseRegisterForm()) return true;
+        if (isFusable(1) && recentOp(0) == OP_SET_LOCAL) {
+            // SET_LOCAL a; POP -> SET_LOCAL_POP a
+            replaceRecent(1, OP_SET_LOCAL_POP, recentArg(0, 1), 0, 0, 2);
+            return true;
+        }
+        return false;
+    }
+
+    if (instruction == OP_RETURN && isFusable(1) && recentOp(0) == OP_CALL
+        && !current->callsLocalFunction) {
+        // CALL; RETURN -> TAIL_CALL; RETURN, 尾调用复用当前帧,
+        // 被调用者不是闭包时退回普通调用, 由后面的RETURN返回结果
+        currentChunk()->code[current->recent[0]] = OP_TAIL_CALL;
+        return false;
+    }
+
+    if (instruction == OP_POP_JUMP_IF_FALSE && isFusable(1)) {
+        // LESS; POP_JUMP_IF_FALSE -> JUMP_IF_NOT_LESS, 跳转偏移随后写入
+        static const uint8_t compareJumps[UINT8_COUNT] = {
+            [OP_LESS] = OP_JUMP_IF_NOT_LESS,
+            [OP_LESS_EQUAL] = OP_JUMP_IF_NOT_LESS_EQUAL,
+            [OP_GREATER] = OP_JUMP_IF_NOT_GREATER,
+            [OP_GREATER_EQUAL] = OP_JUMP_IF_NOT_GREATER_EQUAL,
+            [OP_EQUAL] = OP_JUMP_IF_NOT_EQUAL,
+            [OP_NOT_EQUAL] = OP_JUMP_IF_EQUAL,
+        };
+        uint8_t fused = compareJumps[recentOp(0)];
+        if (fused == 0) return false; // 0是OP_CONSTANT, 不会是比较的结果
+        replaceRecent(1, fused, 0, 0, 0, 1);
+        return true;
+    }
+
+    if ((instruction == OP_ADD || instruction == OP_SUBTRACT)
+        && isFusable(2) && recentOp(1) == OP_GET_LOCAL) {
+        // GET_LOCAL a; GET_LOCAL b; ADD -> ADD_LL a b
+        // GET_LOCAL a; CONSTANT k; ADD  -> ADD_LC a k
+        uint8_t fused;
+        if (recentOp(0) == OP_GET_LOCAL) {
+            fused = instruction == OP_ADD ? OP_ADD_LL : OP_SUBTRACT_LL;
+        } else if (recentOp(0) == OP_CONSTANT) {
+            fused = instruction == OP_ADD ? OP_ADD_LC : OP_SUBTRACT_LC;
+        } else {
+            return false;
+        }
+        replaceRecent(2, fused, recentArg(1, 1), recentArg(0, 1), 0, 3);
+        return true;
+    }
+    return false;
+}
+
 static void emitByte(uint8_t byte) {
+    if (fuseInstruction(byte)) return;
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
@@ -182,6 +374,12 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+static int markJumpTarget() {
+    // 当前位置会被跳转到, 之前的指令不能和之后的指令合并
+    current->jumpTarget = currentChunk()->count;
+    return current->jumpTarget;
+}
+
 static int emitJump(uint8_t instruction) {
     emitByte(instruction);
     emitByte(0xff);
@@ -229,18 +427,180 @@ static void patchJump(int offset) {
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    markJumpTarget();
+}
+
+static void truncateCode(int offset) {
+    // 丢弃offset之后已经生成的代码, 窥孔优化从这里重新开始
+    currentChunk()->count = offset;
+    for (int i = 0; i < RECENT_COUNT; i++) current->recent[i] = -1;
+    current->decoded = offset;
+    markJumpTarget();
 }
 
 // ===
 
+static int stackEffect(uint8_t* code) {
+    // 指令顺序执行时栈深度的变化
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_CLOSURE:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_OUTER:
+        case OP_CLASS:
+        case OP_ADD_LL:
+        case OP_ADD_LC:
+        case OP_SUBTRACT_LL:
+        case OP_SUBTRACT_LC: return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_OR_POP:
+        case OP_JUMP_IF_TRUE_OR_POP:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+        case OP_INDEX_SUBSCR:
+        case OP_SET_LOCAL_POP:
+        case OP_ADD_NUM:
+        case OP_ADD_STR: return -1;
+        case OP_STORE_SUBSCR:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL: return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE: return -code[1];
+        case OP_INVOKE: return -code[3];
+        case OP_SUPER_INVOKE: return -1 - code[3];
+        case OP_BUILD_LIST: return 1 - code[1];
+        default: return 0;
+    }
+}
+
+static int maxStackDepth(ObjFunction* function) {
+    // 语句和表达式都是结构化的, 各条路径汇合时栈深度相同,
+    // 所以顺序累加每条指令的栈效应就能得到最大深度.
+    // 起始深度是被调用者本身和参数
+    Chunk* chunk = &function->chunk;
+    int depth = 1 + function->arity;
+    int max = depth;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        depth += stackEffect(&chunk->code[offset]);
+        if (depth > max) max = depth;
+    }
+    // 超级指令和寄存器形式指令的慢速路径会临时压入两个操作数
+    return max + 2;
+}
+
+static void eliminateCaptures(Local* local) {
+    // 逃逸分析: 只被直接调用的局部函数不会比定义它的那一帧活得更久,
+    // 每次调用时调用者就是这一帧, 它捕获的变量可以按调用者的栈槽直接访问,
+    // 不需要堆上的上值, 闭包也就可以像不捕获变量的函数一样共享
+    if (local->closure == -1 || local->escapes) return;
+    Chunk* chunk = currentChunk();
+    uint8_t* code = &chunk->code[local->closure];
+    local->closure = -1;
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[1]]);
+    int count = function->upvalueCount;
+    for (int i = 0; i < count; i++) {
+        if (!code[2 + i * 2]) return; // 捕获的是外层的上值, 只能经过闭包
+    }
+
+    Chunk* inner = &function->chunk;
+    for (int offset = 0; offset < inner->count;
+         offset += instructionLength(inner, offset)) {
+        uint8_t* instruction = &inner->code[offset];
+        if (instruction[0] != OP_GET_UPVALUE
+            && instruction[0] != OP_SET_UPVALUE) {
+            continue;
+        }
+        instruction[0] =
+            instruction[0] == OP_GET_UPVALUE ? OP_GET_OUTER : OP_SET_OUTER;
+        instruction[1] = code[3 + instruction[1] * 2];
+    }
+    for (int i = 0; i < count; i++) {
+        current->locals[code[3 + i * 2]].captures--;
+    }
+    current->eliminatedCaptures += count;
+#ifdef DEBUG_PRINT_CODE
+    if (!parser.hadError) {
+        // 内层函数在它自己的endCompiler里打印时还没有改写, 这里再打印一次
+        char title[64];
+        snprintf(title, sizeof(title), "%.40s (captures eliminated)",
+                 function->name->chars);
+        disassembleChunk(inner, title);
+    }
+#endif
+
+    // OP_CLOSURE f (isLocal index)* -> OP_CONSTANT closure; OP_SKIP n
+    function->upvalueCount = 0;
+    ObjClosure* closure = newClosure(function); // 函数在常量表里, GC可达
+    chunk->constants.values[code[1]] = OBJ_VAL(closure);
+    code[0] = OP_CONSTANT;
+    code[2] = OP_SKIP;
+    code[3] = count * 2 - 2;
+    markJumpTarget(); // 改写过的指令不再参与合并
+}
+
 static ObjFunction* endCompiler() {
     emitReturn();
+    for (int i = current->localCount - 1; i > 0; i--) {
+        eliminateCaptures(&current->locals[i]);
+    }
     ObjFunction* function = current->function;
+    function->maxStack = maxStackDepth(function);
+    if (function->cacheCount > 0) {
+        PropertyCache* caches = ALLOCATE(PropertyCache, function->cacheCount);
+        for (int i = 0; i < function->cacheCount; i++) {
+            caches[i].shape = NULL;
+            caches[i].next = NULL;
+            caches[i].slot = -1;
+            caches[i].klass = NULL;
+            caches[i].method = NULL;
+        }
+        function->caches = caches;
+    }
+    if (function->invokeCacheCount > 0) {
+        InvokeCache* caches =
+            ALLOCATE(InvokeCache, function->invokeCacheCount);
+        for (int i = 0; i < function->invokeCacheCount; i++) {
+            caches[i].count = 0;
+            caches[i].megamorphic = false;
+        }
+        function->invokeCaches = caches;
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(
             currentChunk(),
             function->name != NULL ? function->name->chars : "<script>");
+        if (current->eliminatedCaptures > 0) {
+            printf("%d captures eliminated\n", current->eliminatedCaptures);
+        }
     }
 #endif
     current =
@@ -262,7 +622,10 @@ static void endScope() {
     while (current->localCount > 0
            && current->locals[current->localCount - 1].depth
                   > current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+        // 局部函数的作用域结束, 它的用法已经确定, 在这之前声明的变量的
+        // 捕获数量也随之确定
+        eliminateCaptures(&current->locals[current->localCount - 1]);
+        if (current->locals[current->localCount - 1].captures > 0) {
             emitByte(OP_CLOSE_UPVALUE);
         } else { // 如果没有被捕获, 就普通的弹出
             emitByte(OP_POP);
@@ -282,6 +645,31 @@ static uint8_t identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static uint16_t globalVariable(Token* name) {
+    // 全局变量在编译时解析成虚拟机全局变量数组的下标
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
+}
+
+static void emitGlobal(uint8_t op, uint16_t slot) {
+    emitByte(op);
+    emitBytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
+static uint16_t methodSelector(Token* name) {
+    // 同上, 方法名在编译时解析成选择子
+    int selector = selectorId(copyString(name->start, name->length));
+    if (selector > UINT16_MAX) {
+        error("Too many method names.");
+        return 0;
+    }
+    return (uint16_t)selector;
+}
+
 static void addLocal(Token name) {
     if (current->localCount == UINT8_COUNT) {
         error("Too many local variables in function.");
@@ -295,6 +683,10 @@ static void addLocal(Token name) {
                        // 当时只声明而未定义,
                        // 以flag -1标记
     local->isCaptured = false;
+    local->isAssigned = false;
+    local->captures = 0;
+    local->closure = -1;
+    local->escapes = false;
 }
 
 static void declareVariable() {
@@ -310,13 +702,13 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
-    if (current->scopeDepth > 0) return 0; // 局部变量不需要名字所在的常量表索引
+    if (current->scopeDepth > 0) return 0; // 局部变量不需要全局变量的下标
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -324,12 +716,12 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     if (current->scopeDepth > 0) { // 局部变量不需要全局变量相关的声明指令
         markInitialized(); // 定义了, 要标记下
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 static void expression();
@@ -359,20 +751,44 @@ static void call(bool canAssign) {
     emitBytes(OP_CALL, argCount);
 }
 
+static void emitPropertyCache() {
+    // 每个属性访问点分配一个内联缓存, 索引跟在指令后面
+    int cache = current->function->cacheCount++;
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one function.");
+    }
+    emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void emitInvokeCache() {
+    // 同上, 每个方法调用点一个
+    int cache = current->function->invokeCacheCount++;
+    if (cache > UINT16_MAX) {
+        error("Too many method calls in one function.");
+    }
+    emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    Token property = parser.previous;
 
     if (canAssign && match(TOKEN_EQUAL)) {
+        uint8_t name = identifierConstant(&property);
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitPropertyCache();
     } else if (match(TOKEN_LEFT_PAREN)) {
+        // 方法调用只需要选择子, 不用把名字放进常量表
+        uint16_t selector = methodSelector(&property);
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        emitGlobal(OP_INVOKE, selector);
         emitByte(argCount);
+        emitInvokeCache();
 
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitBytes(OP_GET_PROPERTY, identifierConstant(&property));
+        emitPropertyCache();
     }
 }
 
@@ -416,12 +832,20 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     int local =
         resolveLocal(compiler->enclosing, name); // 去上一层找它的局部变量
     if (local != -1) {
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        Local* captured = &compiler->enclosing->locals[local];
+        captured->isCaptured = true;
+        captured->escapes = true; // 被内层函数引用, 不再只是直接调用
+        int count = compiler->function->upvalueCount;
+        int index = addUpvalue(compiler, (uint8_t)local, true);
+        if (compiler->function->upvalueCount > count) captured->captures++;
+        return index;
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name); // 递归向上
-    if (upvalue != -1) { return addUpvalue(compiler, (uint8_t)upvalue, false); }
+    if (upvalue != -1) {
+        compiler->enclosing->upvaluesCaptured = true;
+        return addUpvalue(compiler, (uint8_t)upvalue, false);
+    }
 
     return -1;
 }
@@ -432,18 +856,33 @@ static void namedVariable(Token name, bool canAssign) {
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+        if (check(TOKEN_LEFT_PAREN)) {
+            // 直接调用时被调用者的帧紧挨着当前帧, 尾调用会破坏这一点
+            if (current->locals[arg].closure != -1) {
+                current->callsLocalFunction = true;
+            }
+        } else {
+            current->locals[arg].escapes = true;
+        }
     } else if ((arg = resolveUpvalue(current, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
+        arg = globalVariable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        if (setOp == OP_SET_LOCAL) current->locals[arg].isAssigned = true;
+        if (setOp == OP_SET_GLOBAL) {
+            emitGlobal(setOp, (uint16_t)arg);
+        } else {
+            emitBytes(setOp, (uint8_t)arg);
+        }
+    } else if (getOp == OP_GET_GLOBAL) {
+        emitGlobal(getOp, (uint16_t)arg);
     } else {
         emitBytes(getOp, (uint8_t)arg);
     }
@@ -476,15 +915,29 @@ static void super_(bool canAssign) {
     }
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    uint16_t selector = methodSelector(&parser.previous);
     namedVariable(syntheticToken("this"), false);
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    if (match(TOKEN_LEFT_PAREN)) {
+        // 直接调用超类方法, 和dot()里的OP_INVOKE一样省掉绑定方法
+        uint8_t argCount = argumentList();
+        namedVariable(syntheticToken("super"), false);
+        emitGlobal(OP_SUPER_INVOKE, selector);
+        emitByte(argCount);
+        emitInvokeCache();
+    } else {
+        namedVariable(syntheticToken("super"), false);
+        emitGlobal(OP_GET_SUPER, selector);
+    }
 }
 
 static void number(bool canAssign) {
     double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    // 整数字面量用小整数表示, 计数器和下标的运算不用经过浮点
+    if (value <= INT32_MAX && value == (int32_t)value) {
+        emitConstant(INT_VAL((int32_t)value));
+    } else {
+        emitConstant(NUMBER_VAL(value));
+    }
 }
 
 static void string(bool canAssign) {
@@ -530,12 +983,12 @@ static void binary(bool canAssign) {
     parsePrecedence((Precedence)(rule->precedence + 1));
 
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
+        case TOKEN_BANG_EQUAL: emitByte(OP_NOT_EQUAL); break;
         case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
         case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
+        case TOKEN_GREATER_EQUAL: emitByte(OP_GREATER_EQUAL); break;
         case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_LESS_EQUAL: emitByte(OP_LESS_EQUAL); break;
         case TOKEN_PLUS: emitByte(OP_ADD); break;
         case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
         case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
@@ -546,20 +999,14 @@ static void binary(bool canAssign) {
 
 static void add_(bool canAssign) {
     int endJump =
-        emitJump(OP_JUMP_IF_FALSE); // 当&&被运行时, 作为一个中缀,
-                                    // 左边已经知道了, 如果是假则跳过右边
-    emitByte(OP_POP);
+        emitJump(OP_JUMP_IF_FALSE_OR_POP); // 当&&被运行时, 作为一个中缀,
+                                           // 左边已经知道了, 如果是假则跳过右边
     parsePrecedence(PREC_AND);
     patchJump(endJump);
 }
 
 static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
-
-    patchJump(elseJump); // 左侧值为假, 则跳过"跳过全部的语句" -> 不跳过
-    emitByte(OP_POP);
-
+    int endJump = emitJump(OP_JUMP_IF_TRUE_OR_POP); // 左侧值为真, 则跳过右边
     parsePrecedence(PREC_OR);
     patchJump(endJump);
 }
@@ -685,10 +1132,7 @@ static void expression() {
     parsePrecedence(PREC_ASSIGNMENT);
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
-    // 先解析将变量名放到常量表中
-
+static void varDefinition(uint16_t global) {
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
@@ -700,7 +1144,14 @@ static void varDeclaration() {
     // 然后再将"定义全局变量"的指令字节码写入chunk
 }
 
-static void function(FunctionType type) {
+static void varDeclaration() {
+    uint16_t global = parseVariable("Expect variable name.");
+    // 先解析出全局变量的下标
+    varDefinition(global);
+}
+
+static int function(FunctionType type) {
+    // 返回以后可能消除捕获的OP_CLOSURE的偏移, 否则返回-1
     Compiler compiler;
     initCompiler(&compiler, type);
     beginScope();
@@ -712,8 +1163,8 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
+            uint16_t local = parseVariable("Expect parameter name.");
+            defineVariable(local);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
@@ -721,24 +1172,36 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
+    if (function->upvalueCount == 0) {
+        // 不捕获变量的函数每次执行声明得到的闭包都一样,
+        // 编译时就创建好放进常量表, 运行时只需要入栈
+        push(OBJ_VAL(function)); // GC有关
+        ObjClosure* closure = newClosure(function);
+        pop();
+        emitConstant(OBJ_VAL(closure));
+        return -1;
+    }
     // op_closure是一个不定参数的指令
+    int offset = currentChunk()->count;
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
         emitByte(compiler.upvalues[i].index);
     }
+    // 内层函数经过它的上值捕获了变量时, 它必须有真正的上值
+    return compiler.upvaluesCaptured ? -1 : offset;
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    uint16_t selector = methodSelector(&parser.previous);
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4
         && memcmp(parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitGlobal(OP_METHOD, selector);
 }
 
 static void classDeclaration() {
@@ -746,10 +1209,12 @@ static void classDeclaration() {
     Token className = parser.previous;
 
     uint8_t nameConstant = identifierConstant(&parser.previous);
+    uint16_t global =
+        current->scopeDepth > 0 ? 0 : globalVariable(&parser.previous);
     declareVariable();
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(global);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -786,10 +1251,13 @@ static void classDeclaration() {
 
 static void funDeclaration() {
     // 和下面的变量声明很像
-    uint8_t global = parseVariable("Expect function name.");
+    uint16_t global = parseVariable("Expect function name.");
     markInitialized(); // 但是这里和变量很不一样, 声明之后就定义了,
                        // 这在递归中是很有必要的
-    function(TYPE_FUNCTION);
+    int closure = function(TYPE_FUNCTION);
+    if (current->scopeDepth > 0) {
+        current->locals[current->localCount - 1].closure = closure;
+    }
     defineVariable(global);
 }
 
@@ -799,18 +1267,121 @@ static void expressionStatement() {
     emitByte(OP_POP);
 }
 
+typedef struct {
+    uint8_t counter;   // 计数器的栈槽
+    uint8_t limitOp;   // OP_FOR_LOOP: 上界是局部变量; OP_FOR_LOOP_K: 上界是常量
+    uint8_t limit;     // 上界的栈槽或常量索引
+    uint8_t step;      // 步长的常量索引
+} CountedLoop;
+
+static bool isNumberConstant(uint8_t constant) {
+    return IS_NUMBER(currentChunk()->constants.values[constant]);
+}
+
+static bool matchCountedLoop(int counter, int conditionStart, int exitJump,
+                             int incrementStart, CountedLoop* loop) {
+    // 识别 for (var i = ...; i < limit; i = i + step), limit是局部变量或数字
+    // 常量, step是数字常量; 条件和增量已经按通常的方式编译(并经过窥孔优化),
+    // 这里检查生成的指令
+    if (counter == -1 || exitJump == -1) return false;
+    uint8_t* code = currentChunk()->code;
+    int end = currentChunk()->count;
+
+    // 条件: GET_LOCAL i; GET_LOCAL n | CONSTANT k; JUMP_IF_NOT_LESS
+    if (exitJump - 1 != conditionStart + 4
+        || code[conditionStart] != OP_GET_LOCAL
+        || code[conditionStart + 1] != counter
+        || code[exitJump - 1] != OP_JUMP_IF_NOT_LESS) {
+        return false;
+    }
+    loop->counter = (uint8_t)counter;
+    loop->limit = code[conditionStart + 3];
+    if (code[conditionStart + 2] == OP_GET_LOCAL && loop->limit != counter) {
+        loop->limitOp = OP_FOR_LOOP;
+    } else if (code[conditionStart + 2] == OP_CONSTANT
+               && isNumberConstant(loop->limit)) {
+        loop->limitOp = OP_FOR_LOOP_K;
+    } else {
+        return false;
+    }
+
+    // 增量: ADD_RRK i i k (寄存器形式) 或 ADD_LC i k; SET_LOCAL_POP i
+    uint8_t* increment = &code[incrementStart];
+    if (end - incrementStart == 4 && increment[0] == OP_ADD_RRK
+        && increment[1] == counter && increment[2] == counter) {
+        loop->step = increment[3];
+    } else if (end - incrementStart == 5 && increment[0] == OP_ADD_LC
+               && increment[1] == counter && increment[3] == OP_SET_LOCAL_POP
+               && increment[4] == counter) {
+        loop->step = increment[2];
+    } else {
+        return false;
+    }
+    return isNumberConstant(loop->step);
+}
+
+static void emitCountedLoop(CountedLoop* loop, int bodyStart) {
+    // 计数器加步长, 与上界比较, 成立则跳回循环体开头, 一条指令完成
+    emitByte(loop->limitOp);
+    emitByte(loop->counter);
+    emitByte(loop->limit);
+    emitByte(loop->step);
+
+    int offset = currentChunk()->count - bodyStart + 2;
+    if (offset > UINT16_MAX) error("Loop body too large.");
+
+    emitByte((offset >> 8) & 0xff);
+    emitByte(offset & 0xff);
+}
+
+static void forInStatement(Token name) {
+    // for (var x in sequence) body
+    // 两个隐藏的局部变量保存被遍历的容器和游标, 紧接着是循环变量,
+    // 这三个连续的栈槽就是OP_FOR_ITER的迭代器
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for-in clause.");
+    uint8_t iterator = current->localCount;
+    addLocal(syntheticToken("(sequence)"));
+    markInitialized();
+    emitConstant(INT_VAL(0)); // 游标从0开始
+    addLocal(syntheticToken("(cursor)"));
+    markInitialized();
+    emitByte(OP_NIL);
+    addLocal(name);
+    markInitialized();
+
+    int loopStart = markJumpTarget();
+    emitBytes(OP_FOR_ITER, iterator);
+    emitBytes(0xff, 0xff); // 没有更多元素时跳出循环
+    int exitJump = currentChunk()->count - 2;
+    statement();
+    emitLoop(loopStart);
+
+    patchJump(exitJump);
+}
+
 static void forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
+    int counter = -1; // 可能成为计数循环计数器的循环变量
     if (match(TOKEN_SEMICOLON)) {
     } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+        consume(TOKEN_IDENTIFIER, "Expect variable name.");
+        Token name = parser.previous;
+        if (match(TOKEN_IN)) {
+            forInStatement(name);
+            endScope();
+            return;
+        }
+        declareVariable();
+        varDefinition(0); // 这里一定是局部变量
+        counter = current->localCount - 1;
     } else {
         expressionStatement();
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
 
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON)) {
@@ -818,37 +1389,62 @@ static void forStatement() {
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition.
+        exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
     }
 
+    CountedLoop loop;
+    bool counted = false;
     if (!match(TOKEN_RIGHT_PAREN)) {
         // 对于增量语句怎么做呢? 这是循环体还不知道
 
         int bodyJump = emitJump(OP_JUMP); // 首先要跳一下
                                           // 把这一块都跳出去
                                           // 因为最开始这里不用运行
-        int incrementStart = currentChunk()->count;
+        int incrementStart = markJumpTarget();
         expression();
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loopStart); // 然后(实际上这里已经循环一次了), 会跳转到循环开头
-        loopStart =
-            incrementStart; // 然后修改整体循环的距离,
-                            // 这样整体的循环是跳转到这里 自己再跳转到循环开头
-                            // 从而实现将一个再开始编译的代码放在后面编译的代码后面
-        patchJump(bodyJump);
+        counted = matchCountedLoop(
+            counter, loopStart, exitJump, incrementStart, &loop);
+        if (counted) {
+            // 计数循环: 条件只在进入时检查一次, 之后由循环体末尾的
+            // FOR_LOOP递增、比较并跳转, 增量的代码不再需要
+            truncateCode(bodyJump - 1);
+        } else {
+            emitLoop(loopStart); // 然后(实际上这里已经循环一次了),
+                                 // 会跳转到循环开头
+            loopStart =
+                incrementStart; // 然后修改整体循环的距离,
+                                // 这样整体的循环是跳转到这里
+                                // 自己再跳转到循环开头
+                                // 从而实现将一个再开始编译的代码放在后面编译的代码后面
+            patchJump(bodyJump);
+        }
     }
 
+    int bodyStart = markJumpTarget();
+    if (counted) current->locals[counter].isAssigned = false;
     statement();
-    emitLoop(loopStart);
 
-    if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
+    if (!counted) {
+        emitLoop(loopStart);
+    } else if (!current->locals[counter].isAssigned
+               && !current->locals[counter].isCaptured) {
+        emitCountedLoop(&loop, bodyStart);
+    } else {
+        // 循环体修改或捕获了计数器, 退回通用的形式: 在循环体后面
+        // 重新生成增量, 然后跳回条件
+        emitBytes(OP_GET_LOCAL, loop.counter);
+        emitBytes(OP_CONSTANT, loop.step);
+        emitByte(OP_ADD);
+        emitBytes(OP_SET_LOCAL, loop.counter);
+        emitByte(OP_POP);
+        emitLoop(loopStart);
     }
 
+    if (exitJump != -1) patchJump(exitJump);
+
     endScope();
 }
 
@@ -856,32 +1452,29 @@ static void ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // 为了pop condition, 这句话在编译器一定被执行,
-                      // 但是在虚拟中不一定, 因为上面那个指令会跳转,
-                      // 从而把这个pop跳过去
+    int thenJump = emitJump(OP_POP_JUMP_IF_FALSE); // 条件无论真假都出栈
     statement();
-    int elseJump = emitJump(OP_JUMP);
-    // 下面两个先后顺序不关键, 因为回填不影响新加入的指令
-    patchJump(thenJump); // backpathcing回填
-    emitByte(OP_POP);    // 同上
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump); // 回填, 同上
+    if (match(TOKEN_ELSE)) {
+        int elseJump = emitJump(OP_JUMP);
+        patchJump(thenJump); // backpathcing回填
+        statement();
+        patchJump(elseJump); // 回填, 同上
+    } else {
+        patchJump(thenJump); // 没有else, 不需要跳过else分支
+    }
 }
 
 static void whileStatement() {
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
 }
 
 static void block() {
@@ -981,6 +1574,10 @@ ObjFunction* compile(const char* source) {
     return parser.hadError ? NULL : function;
 }
 
+void setRegisterForm(bool enabled) {
+    registerForm = enabled;
+}
+
 void markCompilerRoots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
@@ -5,6 +5,8 @@
 #include "vm.h"
 
 ObjFunction* compile(const char* source);
+// 选择编译目标: 寄存器形式(默认)或纯栈式指令
+void setRegisterForm(bool enabled);
 
 void markCompilerRoots();
 
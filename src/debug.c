@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int simpleInstruction(const char* name, int offset);
 static int byteInstruction(const char* name, Chunk* chunk, int offset);
@@ -10,6 +11,102 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset);
 static int
 jumpInstruction(const char* name, int sign, Chunk* chunk, int offset);
 static int invokeInstruction(const char* name, Chunk* chunk, int offset);
+static int localsInstruction(const char* name, Chunk* chunk, int offset);
+static int
+localConstantInstruction(const char* name, Chunk* chunk, int offset);
+static int registerInstruction(const char* name, Chunk* chunk, int offset);
+static int forIterInstruction(const char* name, Chunk* chunk, int offset);
+static int propertyInstruction(const char* name, Chunk* chunk, int offset);
+static int globalInstruction(const char* name, Chunk* chunk, int offset);
+static int selectorInstruction(const char* name, Chunk* chunk, int offset);
+static int forLoopInstruction(const char* name, Chunk* chunk, int offset);
+static int
+registerConstantInstruction(const char* name, Chunk* chunk, int offset);
+
+static const char* opcodeNames[UINT8_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_OUTER] = "OP_GET_OUTER",
+    [OP_SET_OUTER] = "OP_SET_OUTER",
+    [OP_SKIP] = "OP_SKIP",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_FALSE_OR_POP] = "OP_JUMP_IF_FALSE_OR_POP",
+    [OP_JUMP_IF_TRUE_OR_POP] = "OP_JUMP_IF_TRUE_OR_POP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_BUILD_LIST] = "OP_BUILD_LIST",
+    [OP_INDEX_SUBSCR] = "OP_INDEX_SUBSCR",
+    [OP_STORE_SUBSCR] = "OP_STORE_SUBSCR",
+    [OP_FOR_ITER] = "OP_FOR_ITER",
+    [OP_ADD_LL] = "OP_ADD_LL",
+    [OP_ADD_LC] = "OP_ADD_LC",
+    [OP_SUBTRACT_LL] = "OP_SUBTRACT_LL",
+    [OP_SUBTRACT_LC] = "OP_SUBTRACT_LC",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_LESS_EQUAL] = "OP_JUMP_IF_NOT_LESS_EQUAL",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_NOT_GREATER_EQUAL] = "OP_JUMP_IF_NOT_GREATER_EQUAL",
+    [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+    [OP_FOR_LOOP] = "OP_FOR_LOOP",
+    [OP_FOR_LOOP_K] = "OP_FOR_LOOP_K",
+    [OP_MOVE] = "OP_MOVE",
+    [OP_LOADK] = "OP_LOADK",
+    [OP_ADD_RRR] = "OP_ADD_RRR",
+    [OP_ADD_RRK] = "OP_ADD_RRK",
+    [OP_SUBTRACT_RRR] = "OP_SUBTRACT_RRR",
+    [OP_SUBTRACT_RRK] = "OP_SUBTRACT_RRK",
+    [OP_MULTIPLY_RRR] = "OP_MULTIPLY_RRR",
+    [OP_MULTIPLY_RRK] = "OP_MULTIPLY_RRK",
+    [OP_DIVIDE_RRR] = "OP_DIVIDE_RRR",
+    [OP_DIVIDE_RRK] = "OP_DIVIDE_RRK",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_CALL_CLOSURE] = "OP_CALL_CLOSURE",
+    [OP_GET_FIELD] = "OP_GET_FIELD",
+};
+
+const char* opcodeName(uint8_t opcode) {
+    return opcodeNames[opcode] != NULL ? opcodeNames[opcode] : "OP_UNKNOWN";
+}
 
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
@@ -52,11 +149,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_FALSE: return simpleInstruction("OP_FALSE", offset);
         case OP_POP: return simpleInstruction("OP_POP", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
@@ -65,9 +162,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_OUTER:
+            return byteInstruction("OP_GET_OUTER", chunk, offset);
+        case OP_SET_OUTER:
+            return byteInstruction("OP_SET_OUTER", chunk, offset);
+        case OP_SKIP: {
+            uint8_t skip = chunk->code[offset + 1];
+            printf("%-16s %4d\n", "OP_SKIP", skip);
+            return offset + 2 + skip;
+        }
         case OP_EQUAL: return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER: return simpleInstruction("OP_GREATER", offset);
         case OP_LESS: return simpleInstruction("OP_LESS", offset);
+        case OP_NOT_EQUAL: return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL: return simpleInstruction("OP_LESS_EQUAL", offset);
         case OP_ADD: return simpleInstruction("OP_ADD", offset);
         case OP_SUBTRACT: return simpleInstruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY: return simpleInstruction("OP_MULTIPLY", offset);
@@ -78,21 +188,94 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_JUMP: return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_OR_POP:
+            return jumpInstruction("OP_JUMP_IF_FALSE_OR_POP", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE_OR_POP:
+            return jumpInstruction("OP_JUMP_IF_TRUE_OR_POP", 1, chunk, offset);
         case OP_LOOP: return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL: return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN: return simpleInstruction("OP_RETURN", offset);
         case OP_CLASS: return constantInstruction("OP_CLASS", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
-        case OP_METHOD: return constantInstruction("OP_METHOD", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_METHOD:
+            return selectorInstruction("OP_METHOD", chunk, offset);
         case OP_INVOKE: return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_INHERIT: return simpleInstruction("OP_INHERIT", offset);
         case OP_GET_SUPER:
-            return constantInstruction("OP_GET_SUPER", chunk, offset);
+            return selectorInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_SUPER_INVOKE:
+            return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_INDEX_SUBSCR:
+            return simpleInstruction("OP_INDEX_SUBSCR", offset);
+        case OP_STORE_SUBSCR:
+            return simpleInstruction("OP_STORE_SUBSCR", offset);
+        case OP_FOR_ITER:
+            return forIterInstruction("OP_FOR_ITER", chunk, offset);
+        case OP_ADD_LL: return localsInstruction("OP_ADD_LL", chunk, offset);
+        case OP_ADD_LC:
+            return localConstantInstruction("OP_ADD_LC", chunk, offset);
+        case OP_SUBTRACT_LL:
+            return localsInstruction("OP_SUBTRACT_LL", chunk, offset);
+        case OP_SUBTRACT_LC:
+            return localConstantInstruction("OP_SUBTRACT_LC", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return jumpInstruction(
+                "OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return jumpInstruction(
+                "OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+        case OP_FOR_LOOP:
+            return forLoopInstruction("OP_FOR_LOOP", chunk, offset);
+        case OP_FOR_LOOP_K:
+            return forLoopInstruction("OP_FOR_LOOP_K", chunk, offset);
+        case OP_MOVE: return localsInstruction("OP_MOVE", chunk, offset);
+        case OP_LOADK:
+            return localConstantInstruction("OP_LOADK", chunk, offset);
+        case OP_ADD_RRR:
+            return registerInstruction("OP_ADD_RRR", chunk, offset);
+        case OP_ADD_RRK:
+            return registerConstantInstruction("OP_ADD_RRK", chunk, offset);
+        case OP_SUBTRACT_RRR:
+            return registerInstruction("OP_SUBTRACT_RRR", chunk, offset);
+        case OP_SUBTRACT_RRK:
+            return registerConstantInstruction("OP_SUBTRACT_RRK", chunk,
+                                               offset);
+        case OP_MULTIPLY_RRR:
+            return registerInstruction("OP_MULTIPLY_RRR", chunk, offset);
+        case OP_MULTIPLY_RRK:
+            return registerConstantInstruction("OP_MULTIPLY_RRK", chunk,
+                                               offset);
+        case OP_DIVIDE_RRR:
+            return registerInstruction("OP_DIVIDE_RRR", chunk, offset);
+        case OP_DIVIDE_RRK:
+            return registerConstantInstruction("OP_DIVIDE_RRK", chunk, offset);
+        case OP_ADD_NUM: return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR: return simpleInstruction("OP_ADD_STR", offset);
+        case OP_CALL_CLOSURE:
+            return byteInstruction("OP_CALL_CLOSURE", chunk, offset);
+        case OP_GET_FIELD:
+            return propertyInstruction("OP_GET_FIELD", chunk, offset);
         default: printf("Unknown opcode %d\n", instruction); return offset + 1;
     }
 }
@@ -116,6 +299,34 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int selectorInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t selector = (uint16_t)(chunk->code[offset + 1] << 8);
+    selector |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, selector);
+    printValue(vm.selectorNames.values[selector]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 4;
+}
+
 static int
 jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -125,10 +336,69 @@ jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
 }
 
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
-    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    uint16_t selector = (uint16_t)(chunk->code[offset + 1] << 8);
+    selector |= chunk->code[offset + 2];
+    uint8_t argCount = chunk->code[offset + 3];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 4] << 8);
+    cache |= chunk->code[offset + 5];
+    printf("%-16s (%d args) %4d '", name, argCount, selector);
+    printValue(vm.selectorNames.values[selector]);
+    printf("' (cache %d)\n", cache);
+    return offset + 6;
+}
+
+static int localsInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int
+localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
     return offset + 3;
+}
+
+static int registerInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    uint8_t c = chunk->code[offset + 3];
+    printf("%-16s %4d %4d %4d\n", name, a, b, c);
+    return offset + 4;
+}
+
+static int
+registerConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    uint8_t constant = chunk->code[offset + 3];
+    printf("%-16s %4d %4d %4d '", name, a, b, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int forLoopInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t counter = chunk->code[offset + 1];
+    uint8_t limit = chunk->code[offset + 2];
+    uint8_t step = chunk->code[offset + 3];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 4] << 8);
+    jump |= chunk->code[offset + 5];
+    printf("%-16s %4d %4d %4d '", name, counter, limit, step);
+    printValue(chunk->constants.values[step]);
+    printf("' -> %d\n", offset + 6 - jump);
+    return offset + 6;
+}
+
+static int forIterInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+    printf("%-16s %4d -> %d\n", name, slot, offset + 4 + jump);
+    return offset + 4;
 }
\ No newline at end of file
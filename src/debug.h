@@ -5,5 +5,6 @@
 
 void disassembleChunk(Chunk* chunk, const char* name); // 反汇编所有指令
 int disassembleInstruction(Chunk* chunk, int offset);  // 反汇编一个指令
+const char* opcodeName(uint8_t opcode);                // 操作码的名字
 
 #endif
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "common.h"
 
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 #include "vm.h"
 
@@ -55,18 +56,49 @@ static void runFile(const char* path) {
     if (result == INTERPRET_RUNTIME_ERROR) exit(79);
 }
 
+static void usage() {
+    fprintf(
+        stderr, "Usage: clox [--stack|--register] [--max-depth n] "
+                "[--initial-stack n] [path]\n");
+    exit(64);
+}
+
+static int intOption(int argc, const char* argv[], int arg) {
+    if (arg + 1 >= argc) usage();
+    int value = atoi(argv[arg + 1]);
+    if (value < 1) usage();
+    return value;
+}
+
 int main(int argc, const char* argv[]) {
-    initVM();
+    // --stack/--register选择编译目标, 方便在同一个构建上对比两种指令集;
+    // --max-depth调用深度上限, --initial-stack值栈的初始栈槽数
+    VMConfig config = {STACK_INITIAL, FRAMES_INITIAL, FRAMES_MAX};
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--stack") == 0) {
+            setRegisterForm(false);
+        } else if (strcmp(argv[arg], "--register") == 0) {
+            setRegisterForm(true);
+        } else if (strcmp(argv[arg], "--max-depth") == 0) {
+            config.maxFrames = intOption(argc, argv, arg++);
+        } else if (strcmp(argv[arg], "--initial-stack") == 0) {
+            config.stackSlots = intOption(argc, argv, arg++);
+        } else {
+            usage();
+        }
+    }
 
-    if (argc == 1) {
+    initVM(&config);
+
+    if (argc == arg) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (argc == arg + 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
     freeVM();
     return 0;
-}
\ No newline at end of file
+}
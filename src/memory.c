@@ -37,16 +37,22 @@ static void freeObject(Obj* object) {
         case OBJ_NATIVE: FREE(ObjNative, object); break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
-            // 这里有两个部分的释放
-            // 因为字符串里指向的字符串是创建的
-            // 这个字符串示例本身也是先创建空间再构造的
+            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
             break;
         }
+        case OBJ_ROPE: FREE(ObjRope, object); break;
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
+            if (function->caches != NULL) {
+                FREE_ARRAY(
+                    PropertyCache, function->caches, function->cacheCount);
+            }
+            if (function->invokeCaches != NULL) {
+                FREE_ARRAY(
+                    InvokeCache, function->invokeCaches,
+                    function->invokeCacheCount);
+            }
             // name是ObjString类型的, 在其内部有嵌入式链表, 会自动管理析构
             FREE(ObjFunction, object);
             break;
@@ -56,8 +62,11 @@ static void freeObject(Obj* object) {
             // 而且语义上也是合理的, 因为闭包不应该拥有函数,
             // 一个函数可以被多个闭包捕获
             ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            reallocate(
+                object,
+                sizeof(ObjClosure)
+                    + sizeof(ObjUpvalue*) * closure->upvalueCount,
+                0);
             break;
         }
         case OBJ_UPVALUE: {
@@ -66,16 +75,23 @@ static void freeObject(Obj* object) {
         }
         case OBJ_CLASS: {
             ObjClass* zlass = (ObjClass*)object;
-            freeTable(&zlass->methods);
+            FREE_ARRAY(ObjClosure*, zlass->methods, zlass->methodCount);
             FREE(ObjClass, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
+            FREE_ARRAY(Value, instance->fields, instance->capacity);
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
         case OBJ_BOUND_METHOD: FREE(ObjBoundMethod, object); break;
 
         case OBJ_LIST: {
@@ -150,19 +166,51 @@ static void blackenObject(Obj* object) {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            // 缓存里的类和方法要保留, 否则回收后地址可能被新对象复用而误命中.
+            // 形状从根形状可达, 不需要标记
+            if (function->caches != NULL) {
+                for (int i = 0; i < function->cacheCount; i++) {
+                    markObject((Obj*)function->caches[i].klass);
+                    markObject((Obj*)function->caches[i].method);
+                }
+            }
+            if (function->invokeCaches != NULL) {
+                for (int i = 0; i < function->invokeCacheCount; i++) {
+                    InvokeCache* cache = &function->invokeCaches[i];
+                    for (int j = 0; j < cache->count; j++) {
+                        markObject((Obj*)cache->entries[j].klass);
+                        markObject((Obj*)cache->entries[j].method);
+                    }
+                }
+            }
             break;
         }
         case OBJ_UPVALUE: markValue(((ObjUpvalue*)object)->closed); break;
         case OBJ_CLASS: {
             ObjClass* zlass = (ObjClass*)object;
             markObject((Obj*)zlass->name);
-            markTable(&zlass->methods);
+            for (int i = 0; i < zlass->methodCount; i++) {
+                markObject((Obj*)zlass->methods[i]);
+            }
+            markObject((Obj*)zlass->initializer);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject((Obj*)instance->shape);
+            for (int i = 0; i < instance->shape->slotCount; i++) {
+                markValue(instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            // 形状树从根形状开始整棵保留, 字段名都是源码里的标识符, 数量有限
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            markObject((Obj*)shape->name);
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
             break;
         }
         case OBJ_BOUND_METHOD: {
@@ -171,6 +219,13 @@ static void blackenObject(Obj* object) {
             markObject((Obj*)bound->method);
             break;
         }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*)rope->flat);
+            break;
+        }
         case OBJ_NATIVE:
         case OBJ_STRING: break;
 
@@ -186,7 +241,12 @@ static void markRoots() {
     for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
         markValue(*slot);
     }
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
+    markTable(&vm.methodNames);
+    markTable(&vm.selectors);
+    markArray(&vm.selectorNames);
     for (int i = 0; i < vm.frameCount; i++) {
         markObject((Obj*)vm.frames[i].closure);
     }
@@ -196,6 +256,7 @@ static void markRoots() {
     }
     markCompilerRoots();
     markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.rootShape);
 }
 
 static void traceReferences() {
@@ -5,73 +5,86 @@
 #include "native.h"
 #include "vm.h"
 
-// 内置函数不需要管理Lox虚拟机的栈, 直接在C语义下执行逻辑即可
+// 内置函数不需要管理Lox虚拟机的栈, 直接在C语义下执行逻辑即可.
+// 参数个数在调用时已经按声明检查过, 结果写入args[-1]
 
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
 }
 
-static Value showNative(int argCount, Value* args) {
+static bool showNative(int argCount, Value* args) {
     printf("show(");
     for (int i = 0; i < argCount; i++) {
         printValue(args[i]);
         printf(i == argCount - 1 ? ")\n" : ", ");
     }
-    return NUMBER_VAL(argCount);
+    args[-1] = NUMBER_VAL(argCount);
+    return true;
 }
 
-static Value exitNative(int argCount, Value* args) {
+static bool exitNative(int argCount, Value* args) {
     exit(0);
-    return *args;
+    return true;
 }
 
 // ===
 
-void defineNative(const char* name, NativeFn function) {
+void defineNative(const char* name, NativeFn function, int arity) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(newNative(function, arity)));
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 //
 
-static Value appendNative(int argCount, Value* args) {
+static bool appendNative(int argCount, Value* args) {
     // Append a value to the end of a list increasing the list's length by 1
-    if (argCount != 2 || !IS_LIST(args[0])) {
-        // Handle error
+    if (!IS_LIST(args[0])) {
+        runtimeError("Can only append to a list.");
+        return false;
     }
     ObjList* list = AS_LIST(args[0]);
     Value item = args[1];
     appendToList(list, item);
-    return NIL_VAL;
+    args[-1] = NIL_VAL;
+    return true;
 }
 
-static Value deleteNative(int argCount, Value* args) {
+static bool deleteNative(int argCount, Value* args) {
     // Delete an item from a list at the given index.
-    if (argCount != 2 || !IS_LIST(args[0]) || !IS_NUMBER(args[1])) {
-        // Handle error
+    if (!IS_LIST(args[0])) {
+        runtimeError("Can only delete from a list.");
+        return false;
+    }
+    if (!IS_NUMBER(args[1])) {
+        runtimeError("List index is not a number.");
+        return false;
     }
 
     ObjList* list = AS_LIST(args[0]);
-    int index = AS_NUMBER(args[1]);
+    int index = IS_INT(args[1]) ? AS_INT(args[1]) : (int)AS_DOUBLE(args[1]);
 
     if (!isValidListIndex(list, index)) {
-        // Handle error
+        runtimeError("List index out of range.");
+        return false;
     }
 
     deleteFromList(list, index);
-    return NIL_VAL;
+    args[-1] = NIL_VAL;
+    return true;
 }
 
 //
 
 void nativeRegister() {
-    defineNative("clock", clockNative);
-    defineNative("show", showNative);
-    defineNative("exit", exitNative);
+    defineNative("clock", clockNative, 0);
+    defineNative("show", showNative, NATIVE_VARIADIC);
+    defineNative("exit", exitNative, NATIVE_VARIADIC);
 
-    defineNative("append", appendNative);
-    defineNative("delete", deleteNative);
-}
\ No newline at end of file
+    defineNative("append", appendNative, 2);
+    defineNative("delete", deleteNative, 2);
+}
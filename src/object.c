@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -10,6 +11,8 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
+#define SHORT_STRING_MAX 64 // 拼接结果更长时创建绳子, 不立即拼接
+
 static Obj* allocateObject(size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
@@ -26,22 +29,37 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStack = 0;
+    function->cacheCount = 0;
+    function->caches = NULL;
+    function->invokeCacheCount = 0;
+    function->invokeCaches = NULL;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjNative* newNative(NativeFn function, int arity) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
     return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* allocateString(int length) {
+    // 字符跟在结构体后面, 一次分配; 由调用者填写字符, 需要时再驻留
+    ObjString* string = (ObjString*)allocateObject(
+        sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->hash = 0;
+    string->interned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+static ObjString* internString(ObjString* string, uint32_t hash) {
     string->hash = hash;
+    string->interned = true;
     // GC有关, 原因见chunk.c addConstant()注释
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -58,17 +76,12 @@ static uint32_t hashString(const char* key, int length) { // FNV-1a
     return hash;
 }
 
-ObjString* takeString(char* chars, int length) {
-    // 虚拟机内部使用
-    // 将C下的字符串转换成lox的ObjString
-    // 该字符串可以直接用(C语义下的)
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+uint32_t stringHash(ObjString* string) {
+    // 没有驻留的字符串用到时才计算哈希; 哈希恰好是0的会每次重新计算, 结果不变
+    if (string->hash == 0) {
+        string->hash = hashString(string->chars, string->length);
     }
-    return allocateString(chars, length, hash);
+    return string->hash;
 }
 
 ObjString* copyString(const char* chars, int length) {
@@ -79,19 +92,108 @@ ObjString* copyString(const char* chars, int length) {
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) return interned;
     // 如果这个字符串已经被虚拟机驻留过, 说明已经被接管过, 不用再拷贝独立的了
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return internString(string, hash);
+}
+
+static int textLength(Obj* text) {
+    return text->type == OBJ_STRING ? ((ObjString*)text)->length
+                                    : ((ObjRope*)text)->length;
+}
+
+// 字符串和已经拼接过的绳子返回对应的字符串, 还没拼接的绳子返回NULL
+static ObjString* flatText(Obj* text) {
+    return text->type == OBJ_STRING ? (ObjString*)text
+                                    : ((ObjRope*)text)->flat;
+}
+
+static void writeText(Obj* text, char* dest, int length) {
+    // 把text的length个字符写到dest. 从右往左填, 待处理的节点放在堆上的
+    // 工作栈里而不是递归: 绳子可以有任意深, 递归会把C栈用完.
+    // 工作栈用系统调用分配, 打印时不能触发GC(同memory.c的灰色栈)
+    int capacity = 8;
+    int count = 0;
+    Obj** work = (Obj**)malloc(sizeof(Obj*) * capacity);
+    if (work == NULL) exit(1);
+    work[count++] = text;
+    int end = length;
+    while (count > 0) {
+        Obj* node = work[--count];
+        ObjString* string = flatText(node);
+        if (string != NULL) {
+            end -= string->length;
+            memcpy(dest + end, string->chars, string->length);
+            continue;
+        }
+        // 先处理右边, 左边留在栈里; 反复追加得到的链栈只有两三项
+        if (capacity < count + 2) {
+            capacity = GROW_CAPACITY(capacity);
+            work = (Obj**)realloc(work, sizeof(Obj*) * capacity);
+            if (work == NULL) exit(1);
+        }
+        ObjRope* rope = (ObjRope*)node;
+        work[count++] = rope->left;
+        work[count++] = rope->right;
+    }
+    free(work);
+}
+
+Value concatStrings(Value a, Value b) {
+    // 虚拟机内部使用, a和b需要在栈上(分配可能触发GC)
+    Obj* left = AS_OBJ(a);
+    Obj* right = AS_OBJ(b);
+    int length = textLength(left) + textLength(right);
+    if (length <= SHORT_STRING_MAX) {
+        // 绳子都比SHORT_STRING_MAX长, 这里两边一定是ObjString.
+        // 短字符串的哈希很便宜, 先在栈上拼接, 和它相同的字面量或标识符
+        // 已经驻留时直接用那个; 否则分配一个不驻留的字符串, 也不插入vm.strings
+        char chars[SHORT_STRING_MAX];
+        memcpy(chars, AS_STRING(a)->chars, AS_STRING(a)->length);
+        memcpy(chars + AS_STRING(a)->length, AS_STRING(b)->chars,
+               AS_STRING(b)->length);
+        uint32_t hash = hashString(chars, length);
+        ObjString* interned =
+            tableFindString(&vm.strings, chars, length, hash);
+        if (interned != NULL) return OBJ_VAL(interned);
+        ObjString* string = allocateString(length);
+        memcpy(string->chars, chars, length);
+        string->hash = hash;
+        return OBJ_VAL(string);
+    }
+    // 长字符串不复制字符, 循环里反复追加时每次只分配一个绳子节点;
+    // 已经拼接过的绳子直接换成它的结果, 让它自己可以被回收
+    ObjString* leftString = flatText(left);
+    ObjString* rightString = flatText(right);
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = leftString != NULL ? (Obj*)leftString : left;
+    rope->right = rightString != NULL ? (Obj*)rightString : right;
+    rope->flat = NULL;
+    return OBJ_VAL(rope);
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+    // rope需要在栈上(分配可能触发GC), 结果会缓存在rope->flat
+    if (rope->flat != NULL) return rope->flat;
+    ObjString* string = allocateString(rope->length);
+    writeText((Obj*)rope, string->chars, rope->length);
+    rope->flat = string;
+    rope->left = NULL;
+    rope->right = NULL;
+    return string;
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) { upvalues[i] = NULL; }
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    // 上值数组跟在闭包后面, 一次分配
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount,
+        OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
@@ -106,17 +208,142 @@ ObjUpvalue* newUpvalue(Value* slot) {
 ObjClass* newClass(ObjString* name) {
     ObjClass* zlass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     zlass->name = name;
-    initTable(&zlass->methods);
+    zlass->methods = NULL;
+    zlass->methodCount = 0;
+    zlass->initializer = NULL;
+    zlass->fieldCount = 0;
     return zlass;
 }
 
+static void growMethods(ObjClass* klass, int count) {
+    // 类和方法都在栈上, 扩容触发GC也不会被回收
+    if (count <= klass->methodCount) return;
+    klass->methods = GROW_ARRAY(
+        ObjClosure*, klass->methods, klass->methodCount, count);
+    for (int i = klass->methodCount; i < count; i++) klass->methods[i] = NULL;
+    klass->methodCount = count;
+}
+
+void setMethod(ObjClass* klass, int selector, ObjClosure* method) {
+    growMethods(klass, selector + 1);
+    klass->methods[selector] = method;
+}
+
+void inheritMethods(ObjClass* subclass, ObjClass* superclass) {
+    // 子类的方法都在继承之后定义, 这里直接复制超类的方法表,
+    // 只是一次内存拷贝, 不用逐项重新哈希.
+    // 超类没有方法时methods是NULL, 不能传给memcpy
+    if (superclass->methodCount == 0) return;
+    growMethods(subclass, superclass->methodCount);
+    memcpy(subclass->methods, superclass->methods,
+           sizeof(ObjClosure*) * superclass->methodCount);
+}
+
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slotCount = 0;
+    shape->shadowsMethod = false;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    if (parent == NULL) return shape;
+
+    // GC有关, 填表时可能触发回收
+    push(OBJ_VAL(shape));
+    tableAddAll(&parent->slots, &shape->slots);
+    shape->slotCount = parent->slotCount + 1;
+    Value unused;
+    shape->shadowsMethod = parent->shadowsMethod
+                        || tableGet(&vm.methodNames, name, &unused);
+    tableSet(&shape->slots, name, NUMBER_VAL(parent->slotCount));
+    tableSet(&parent->transitions, name, OBJ_VAL(shape));
+    pop();
+    return shape;
+}
+
+static void markShadowing(ObjShape* shape, ObjString* name) {
+    // 加入该字段后的形状及其所有子形状都要标记, name为NULL时全部标记
+    for (int i = 0; i < shape->transitions.capacity; i++) {
+        Entry* entry = &shape->transitions.entries[i];
+        if (entry->key == NULL) continue;
+        ObjShape* child = AS_SHAPE(entry->value);
+        if (name == NULL || entry->key == name) {
+            child->shadowsMethod = true;
+            markShadowing(child, NULL);
+        } else {
+            markShadowing(child, name);
+        }
+    }
+}
+
+void addMethodName(ObjString* name) {
+    // 第一次出现的方法名, 已有的同名字段现在会遮住方法
+    Value unused;
+    if (tableGet(&vm.methodNames, name, &unused)) return;
+    tableSet(&vm.methodNames, name, NIL_VAL);
+    markShadowing(vm.rootShape, name);
+}
+
 ObjInstance* newInstance(ObjClass* klass) {
+    // 先分配字段数组: 它不是GC对象, 之后分配实例触发GC也不影响它
+    int capacity = klass->fieldCount;
+    Value* fields = capacity > 0 ? ALLOCATE(Value, capacity) : NULL;
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm.rootShape;
+    instance->capacity = capacity;
+    instance->fields = fields;
     return instance;
 }
 
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+bool getField(ObjInstance* instance, ObjString* name, Value* value) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+void reserveFields(ObjInstance* instance, int count) {
+    if (count <= instance->capacity) return;
+    // 超出了类记录的字段数, 以后的实例按新的数量预留
+    if (count > instance->klass->fieldCount) {
+        instance->klass->fieldCount = count;
+    }
+    int capacity = GROW_CAPACITY(instance->capacity);
+    while (capacity < count) capacity = GROW_CAPACITY(capacity);
+    instance->fields =
+        GROW_ARRAY(Value, instance->fields, instance->capacity, capacity);
+    instance->capacity = capacity;
+}
+
+int setField(ObjInstance* instance, ObjString* name, Value value) {
+    // 调用者要保证instance和value在栈上, 形状迁移和扩容都可能触发GC
+    int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+        instance->fields[slot] = value;
+        return slot;
+    }
+
+    Value next;
+    ObjShape* shape;
+    if (tableGet(&instance->shape->transitions, name, &next)) {
+        shape = AS_SHAPE(next);
+    } else {
+        shape = newShape(instance->shape, name);
+    }
+    reserveFields(instance, shape->slotCount);
+    instance->shape = shape;
+    instance->fields[shape->slotCount - 1] = value;
+    return shape->slotCount - 1;
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
@@ -142,6 +369,19 @@ void printObjString(ObjString* objstring) {
     printf("%s", objstring->chars);
 }
 
+void printObjRope(ObjRope* rope) {
+    if (rope->flat != NULL) {
+        printObjString(rope->flat);
+        return;
+    }
+    // 打印时值可能已经出栈, 不能用会触发GC的分配, 临时缓冲区直接malloc
+    char* chars = (char*)malloc(rope->length);
+    if (chars == NULL) exit(1);
+    writeText((Obj*)rope, chars, rope->length);
+    fwrite(chars, 1, rope->length, stdout);
+    free(chars);
+}
+
 void printObjClosure(ObjClosure* closure) {
     printFunction(closure->function);
 }
@@ -173,8 +413,9 @@ void printObjList(ObjList* list) {
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_FUNCTION: printFunction(AS_FUNCTION(value)); break;
-        case OBJ_NATIVE: printNative(AS_NATIVE(value)); break;
+        case OBJ_NATIVE: printNative(AS_NATIVE(value)->function); break;
         case OBJ_STRING: printObjString(AS_STRING(value)); break;
+        case OBJ_ROPE: printObjRope(AS_ROPE(value)); break;
         case OBJ_CLOSURE: printObjClosure(AS_CLOSURE(value)); break;
         case OBJ_UPVALUE: printObjUpvalue(AS_CLOSURE(value)); break;
         case OBJ_CLASS: printObjClass(AS_CLASS(value)); break;
@@ -182,6 +423,7 @@ void printObject(Value value) {
         case OBJ_BOUND_METHOD:
             printObjBoundMethod(AS_BOUND_METHOD(value));
             break;
+        case OBJ_SHAPE: printf("shape"); break;
         case OBJ_LIST: printObjList(AS_LIST(value));
         default: break;
     }
@@ -230,3 +472,12 @@ bool isValidListIndex(ObjList* list, int index) {
     if (index < 0 || index > list->count - 1) { return false; }
     return true;
 }
+
+bool nextListItem(ObjList* list, Value* cursor, Value* item) {
+    // 游标是下一个元素的下标, 循环体可能删除元素, 所以每次都和count比较
+    int index = AS_INT(*cursor);
+    if (index >= list->count) return false;
+    *item = list->items[index];
+    *cursor = INT_VAL(index + 1);
+    return true;
+}
\ No newline at end of file
@@ -11,6 +11,9 @@
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+// 字符串值: ObjString或者还没有拼接的ObjRope
+#define IS_STRING_OR_ROPE(value) (IS_STRING(value) || IS_ROPE(value))
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
@@ -18,12 +21,14 @@
 #define IS_LIST(value)         isObjType(value, OBJ_LIST)
 // Value -> 具体的Object
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
-#define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_UPVALUE(value)      ((ObjUpvalue*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
 
@@ -33,11 +38,13 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_STRING,
+    OBJ_ROPE,
     OBJ_CLOSURE,
     OBJ_UPVALUE,
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
 
     OBJ_LIST,
 } ObjType;
@@ -49,19 +56,58 @@ struct Obj {
                       // 用来保证虚拟机可以找到每个堆内存的对象
 };
 
+struct ObjShape;
+struct ObjClass;
+struct ObjClosure;
+
+// 属性访问的内联缓存, 每个GET/SET_PROPERTY指令一个, 记住上次接收者的形状
+// 和查找结果, 形状相同时不用再查哈希表
+typedef struct {
+    struct ObjShape* shape;     // 上次接收者的形状, NULL表示还没有缓存
+    struct ObjShape* next;      // SET: 赋值后的形状(加入新字段时是子形状)
+    int slot;                   // 字段的槽位, -1表示缓存的是方法
+    struct ObjClass* klass;     // GET: 缓存方法时接收者的类
+    struct ObjClosure* method;  // GET: 缓存的方法
+} PropertyCache;
+
+// 方法调用的多态内联缓存, 每个INVOKE指令一个, 记住见过的类和解析出的方法.
+// 见过的类超过INVOKE_CACHE_SIZE个就不再缓存(megamorphic), 直接查表
+#define INVOKE_CACHE_SIZE 4
+
+typedef struct {
+    struct ObjClass* klass;
+    struct ObjClosure* method;
+} InvokeEntry;
+
+typedef struct {
+    int count;
+    bool megamorphic;
+    InvokeEntry entries[INVOKE_CACHE_SIZE];
+} InvokeCache;
+
 typedef struct {
     Obj obj;
     int arity;        // 参数数量
     int upvalueCount; // 当前逻辑块的上值数量
+    int maxStack;     // 执行时最多占用的栈槽数, 调用前据此保证栈的容量
+    int cacheCount;   // 属性访问点的数量
+    PropertyCache* caches; // 编译结束时分配
+    int invokeCacheCount;  // 方法调用点的数量
+    InvokeCache* invokeCaches; // 同上
     Chunk chunk;      // 函数逻辑字节码
     ObjString* name;  // 函数名称
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// 本地函数直接在虚拟机栈上工作: 参数是args[0..argCount-1],
+// 结果写入args[-1](被调用者所在的槽). 出错时调用runtimeError并返回false
+typedef bool (*NativeFn)(int argCount, Value* args);
+
+#define NATIVE_VARIADIC -1 // 参数数量不定, 由本地函数自己检查
 
 typedef struct {
     Obj obj;
     NativeFn function;
+    int arity; // 声明的参数数量, 调用时检查一次
 } ObjNative;
 
 struct ObjString {
@@ -69,10 +115,23 @@ struct ObjString {
     // 然后正常访问type属性, 而实际上反向转换也是可以的(当然安全性由用户保证)
     Obj obj;
     int length;
-    char* chars;
+    // 驻留的字符串(源码里的标识符和字面量)和运行时的短字符串创建时就计算
+    // 哈希; 绳子拼接出的长字符串第一次比较时才计算(见stringHash), 之前为0
     uint32_t hash;
+    bool interned; // 只有驻留的字符串能作为Table的键, 按地址比较
+    char chars[];  // 柔性数组, 和字符串一起分配, 以'\0'结尾
 };
 
+// 绳子: 运行时拼接出的长字符串先只记下两边(ObjString或ObjRope), 等真正
+// 需要字符(比较, 打印)时才拼接成ObjString, 之后两边交给GC回收
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left;  // 拼接后为NULL
+    Obj* right; // 拼接后为NULL
+    ObjString* flat; // 拼接的结果, 还没拼接时为NULL
+} ObjRope;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location; // 指针(各个上值的底层Value离散在堆中)
@@ -80,24 +139,42 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue* next; //
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function; // 此时ObjFunction更像是对底层函数的封装
-    ObjUpvalue** upvalues; // ObjUpvalue* upvalues[], 因为上值存储在栈中,
-                           // 肯定用指针, 但是C不允许定义name[]
     int upvalueCount;
+    ObjUpvalue* upvalues[]; // 柔性数组, 和闭包一起分配
 } ObjClosure;
 
-typedef struct {
+typedef struct ObjClass {
     Obj obj;
     ObjString* name;
-    Table methods;
+    // 方法表(虚表): 以选择子为下标, 没有该方法的是NULL.
+    // 长度只到类定义过的最大选择子, 超出的都视为没有
+    struct ObjClosure** methods;
+    int methodCount;
+    struct ObjClosure* initializer; // 即methods中的init, 没有则为NULL
+    int fieldCount; // 实例最多有过的字段数, 新实例按它预留字段的空间
 } ObjClass;
 
+// 隐藏类: 同样顺序加入同样字段的实例共享一个形状, 形状记录字段名到槽位的映射,
+// 实例只保存字段值. 形状构成一棵树, 加入新字段就沿着transitions走到子形状
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent; // 少最后一个字段的形状, 根形状为NULL
+    ObjString* name;         // 最后加入的字段名
+    int slotCount;           // 字段数量
+    bool shadowsMethod;      // 有字段和某个方法同名, 调用方法前要先查字段
+    Table slots;             // 字段名 -> 槽位(数字)
+    Table transitions;       // 字段名 -> 加入该字段后的子形状
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;
+    int capacity; // fields的容量, 字段数量是shape->slotCount
+    Value* fields;
 } ObjInstance;
 
 typedef struct {
@@ -107,16 +184,26 @@ typedef struct {
 } ObjBoundMethod;
 
 ObjFunction* newFunction();
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(NativeFn function, int arity);
 
-ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+Value concatStrings(Value a, Value b);
+ObjString* flattenRope(ObjRope* rope);
+uint32_t stringHash(ObjString* string);
 
 ObjClosure* newClosure(ObjFunction* function);
 ObjUpvalue* newUpvalue(Value* slot);
 
 ObjClass* newClass(ObjString* name);
+ObjShape* newShape(ObjShape* parent, ObjString* name);
 ObjInstance* newInstance(ObjClass* klass);
+void setMethod(ObjClass* klass, int selector, ObjClosure* method);
+void inheritMethods(ObjClass* subclass, ObjClass* superclass);
+void addMethodName(ObjString* name);
+int shapeSlot(ObjShape* shape, ObjString* name); // 没有该字段时返回-1
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+void reserveFields(ObjInstance* instance, int count); // 可能触发GC
+int setField(ObjInstance* instance, ObjString* name, Value value); // 返回槽位
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 
 void printObject(Value value);
@@ -125,6 +212,11 @@ static bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline ObjClosure* findMethod(ObjClass* klass, int selector) {
+    // 查方法只是一次数组访问, 没有该方法时返回NULL
+    return selector < klass->methodCount ? klass->methods[selector] : NULL;
+}
+
 //
 
 typedef struct {
@@ -140,5 +232,6 @@ void storeToList(ObjList* list, int index, Value value);
 Value indexFromList(ObjList* list, int index);
 void deleteFromList(ObjList* list, int index);
 bool isValidListIndex(ObjList* list, int index);
+bool nextListItem(ObjList* list, Value* cursor, Value* item);
 
 #endif
\ No newline at end of file
@@ -36,6 +36,7 @@ typedef enum {
     TOKEN_FOR,    // token_for,
     TOKEN_FUN,    // token_fun,
     TOKEN_IF,     // token_if,
+    TOKEN_IN,     // token_in,
     TOKEN_NIL,    // token_nil,
     TOKEN_OR,     // token_or,
     TOKEN_PRINT,  // token_print,
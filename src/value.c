@@ -29,26 +29,62 @@ void freeValueArray(ValueArray* array) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    } else if (IS_UNDEFINED(value)) {
+        printf("undefined");
+    }
+#else
     switch (value.type) {
         case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
         case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_NUMBER:
+        case VAL_INT: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: printf("undefined"); break;
     }
+#endif
+}
+
+static bool stringsEqual(ObjString* a, ObjString* b) {
+    // 两个都驻留时地址不同就不相等; 运行时的字符串没有驻留,
+    // 先比较长度和(第一次用到时才计算的)哈希, 最后比较内容
+    if (a == b) return true;
+    if (a->interned && b->interned) return false;
+    return a->length == b->length && stringHash(a) == stringHash(b)
+           && memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 bool valuesEqual(Value a, Value b) {
+    // 调用者要先把绳子拼接成字符串(flattenRope)
+    if (IS_STRING(a) && IS_STRING(b)) {
+        return stringsEqual(AS_STRING(a), AS_STRING(b));
+    }
+#ifdef NAN_BOXING
+    // 数字按double比较(NaN不等于自身, 整数等于值相同的double),
+    // 其他值的位模式相同就相等
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    return a == b;
+#else
     // 对于相等, 为什么不直接比较字节呢? 因为struct会有填充位,
     // 并不能保证里面有什么
+    if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+    // 整数和值相同的double相等
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL: return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b); // 因为所有的字符串都驻留在虚拟机中,
-                                           // 这样的话如果地址一样的话,
-                                           // 那么指向的真的是同一个字符串
+        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b); // 字符串在上面比较过
         default: return false;
     }
-}
\ No newline at end of file
+#endif
+}
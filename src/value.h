@@ -6,20 +6,80 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// NaN boxing: 值就是一个64位整数. double直接保存它的位模式, 其余的值藏在
+// 静默NaN(所有指数位和最高的两个尾数位为1)剩下的位里: 对象指针占低48位并
+// 置上符号位, 小整数占低32位并置上INT_TAG, nil/false/true/undefined是几个
+// 很小的标签
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+#define INT_TAG  ((uint64_t)0x0002000000000000)
+
+#define TAG_NIL       1 // 01
+#define TAG_FALSE     2 // 10
+#define TAG_TRUE      3 // 11
+#define TAG_UNDEFINED 4 // 100
+
+typedef uint64_t Value;
+
+// check
+#define IS_BOOL(value)   (((value) | 1) == TRUE_VAL) // false和true只差最低位
+#define IS_NIL(value)    ((value) == NIL_VAL)
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | INT_TAG)) == (QNAN | INT_TAG))
+#define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+// Value -> C
+#define AS_OBJ(value)    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_DOUBLE(value) valueToNum(value)
+#define AS_INT(value)    ((int32_t)(uint32_t)(value))
+// C -> Value
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)   numToValue(num)
+#define INT_VAL(i)        ((Value)(QNAN | INT_TAG | (uint32_t)(i)))
+#define OBJ_VAL(obj)      (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+// 用memcpy做类型双关(type punning), 编译器会把它优化成一次寄存器移动
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 // tagged union
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
-    VAL_NUMBER,
+    VAL_NUMBER, // double
+    VAL_INT,    // 小整数, 在Lox程序看来和值相同的double没有区别
     VAL_OBJ,
+    VAL_UNDEFINED, // 虚拟机内部使用: 还没有定义的全局变量, Lox程序看不到它
 } ValueType;
 
 typedef struct {
-    ValueType type;
+    int64_t type; // ValueType, 和union一样占满8字节
 
     union {
         bool boolean;
         double number;
+        int64_t integer; // 只用int32的范围, 占满8字节
         Obj* obj;
     } as;
 } Value;
@@ -27,17 +87,33 @@ typedef struct {
 // check
 #define IS_BOOL(value)   ((value).type == VAL_BOOL)
 #define IS_NIL(value)    ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value)    ((value).type == VAL_INT)
 #define IS_OBJ(value)    ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 // union -> C
 #define AS_OBJ(value)    ((value).as.obj)
 #define AS_BOOL(value)   ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_DOUBLE(value) ((value).as.number)
+#define AS_INT(value)    ((int32_t)(value).as.integer)
 // C -> union  // 要求C值正确(但不检测)
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
+
+// 数字有double和小整数两种表示, IS_NUMBER/AS_NUMBER对两者都适用;
+// 热点路径先用IS_INT/AS_INT检查整数, 其余情况按double计算
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
+#define AS_NUMBER(value) valueToDouble(value)
+
+static inline double valueToDouble(Value value) {
+    return IS_INT(value) ? (double)AS_INT(value) : AS_DOUBLE(value);
+}
 
 bool valuesEqual(Value a, Value b);
 
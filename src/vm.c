@@ -1,5 +1,6 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
@@ -18,14 +19,86 @@ static void resetStack() {
     vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
+#ifdef DEBUG_PROFILE_OPCODES
+// 相邻两条指令(opcode pair)的执行次数, 虚拟机退出时输出,
+// 用superinstructions.sh分析哪些指令序列值得合并成超级指令
+static uint64_t opcodePairs[UINT8_COUNT][UINT8_COUNT];
+static int lastOpcode = -1;
+
+static void profileOpcode(uint8_t opcode) {
+    if (lastOpcode != -1) opcodePairs[lastOpcode][opcode]++;
+    lastOpcode = opcode;
+}
+
+static void printOpcodeProfile() {
+    fprintf(stderr, "== opcode pairs ==\n");
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        for (int j = 0; j < UINT8_COUNT; j++) {
+            if (opcodePairs[i][j] == 0) continue;
+            // 前一条转移控制时标上transfer, 这样的指令对不能合并
+            fprintf(
+                stderr, "%s %s %llu%s\n", opcodeName(i), opcodeName(j),
+                (unsigned long long)opcodePairs[i][j],
+                transfersControl(i) ? " transfer" : "");
+        }
+    }
+}
+#endif
+
+#ifdef DEBUG_PROFILE_CACHES
+// 内联缓存的命中次数, 虚拟机退出时输出
+typedef struct {
+    const char* name;
+    uint64_t hits;
+    uint64_t misses;
+} CacheStats;
+
+static CacheStats getPropertyStats = {"get property", 0, 0};
+static CacheStats setPropertyStats = {"set property", 0, 0};
+static CacheStats invokeStats = {"invoke", 0, 0};
+static CacheStats superInvokeStats = {"super invoke", 0, 0};
+
+#define CACHE_HIT(stats)  ((stats).hits++)
+#define CACHE_MISS(stats) ((stats).misses++)
+
+static void printCacheStats(CacheStats* stats) {
+    uint64_t total = stats->hits + stats->misses;
+    fprintf(
+        stderr, "%-16s %12llu hits %12llu misses %7.2f%%\n", stats->name,
+        (unsigned long long)stats->hits, (unsigned long long)stats->misses,
+        total == 0 ? 0.0 : 100.0 * stats->hits / total);
+}
+
+static void printCacheProfile() {
+    fprintf(stderr, "== inline caches ==\n");
+    printCacheStats(&getPropertyStats);
+    printCacheStats(&setPropertyStats);
+    printCacheStats(&invokeStats);
+    printCacheStats(&superInvokeStats);
+}
+#else
+#define CACHE_HIT(stats)  ((void)0)
+#define CACHE_MISS(stats) ((void)0)
+#endif
+
+#define TRACE_MAX 64 // 错误信息最多打印的调用帧数
+
+void runtimeError(const char* format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
+    // 调用栈很深时只打印两端, 中间的帧省略
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (vm.frameCount > TRACE_MAX
+            && i == vm.frameCount - TRACE_MAX / 2 - 1) {
+            i = TRACE_MAX / 2 - 1;
+            fprintf(
+                stderr, "... %d frames omitted\n",
+                vm.frameCount - TRACE_MAX);
+        }
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
@@ -40,7 +113,21 @@ static void runtimeError(const char* format, ...) {
     resetStack();
 }
 
-void initVM() {
+static void* allocateStack(size_t size) {
+    // 栈不是托管内存, 不计入bytesAllocated, 分配时也不会触发GC
+    void* block = malloc(size);
+    if (block == NULL) exit(1);
+    return block;
+}
+
+void initVM(const VMConfig* config) {
+    VMConfig defaults = {STACK_INITIAL, FRAMES_INITIAL, FRAMES_MAX};
+    if (config == NULL) config = &defaults;
+    vm.stackCapacity = config->stackSlots < 1 ? 1 : config->stackSlots;
+    vm.stack = allocateStack(sizeof(Value) * vm.stackCapacity);
+    vm.frameCapacity = config->frames < 1 ? 1 : config->frames;
+    vm.frames = allocateStack(sizeof(CallFrame) * vm.frameCapacity);
+    vm.maxFrames = config->maxFrames < 1 ? 1 : config->maxFrames;
     resetStack();
     vm.objects = NULL;
 
@@ -51,26 +138,126 @@ void initVM() {
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
     initTable(&vm.strings);
+    initTable(&vm.methodNames);
+    initTable(&vm.selectors);
+    initValueArray(&vm.selectorNames);
 
     // 为什么先初始化为null再赋值呢? 因为copyString可能触发GC
     // 一旦触发GC且这个变量没有初始化, 此时对其的GC是UB(它还没有初始化,
     // 它可能指向任何地方)
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
+    vm.rootShape = NULL;
+    vm.rootShape = newShape(NULL, NULL);
 
     nativeRegister();
 }
 
 void freeVM() {
-    freeTable(&vm.globals);
+#ifdef DEBUG_PROFILE_OPCODES
+    printOpcodeProfile();
+#endif
+#ifdef DEBUG_PROFILE_CACHES
+    printCacheProfile();
+#endif
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
     freeTable(&vm.strings);
+    freeTable(&vm.methodNames);
+    freeTable(&vm.selectors);
+    freeValueArray(&vm.selectorNames);
     vm.initString = NULL; // 不需要释放, 由GC管理
+    vm.rootShape = NULL;
     freeObjects();
+    free(vm.stack);
+    free(vm.frames);
+    vm.stack = NULL;
+    vm.frames = NULL;
+}
+
+static void growStack(int needed) {
+    // 换一块更大的内存, 并修正所有指向旧栈的指针
+    int capacity = vm.stackCapacity;
+    while (capacity < needed) capacity *= 2;
+    Value* stack = allocateStack(sizeof(Value) * capacity);
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    // 打开的上值还指向栈上的变量
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackCapacity = capacity;
+}
+
+static void reserveStack(CallFrame* frame) {
+    // 函数执行期间不再检查栈的容量, 所以进入函数时一次性预留够
+    int needed =
+        (int)(frame->slots - vm.stack) + frame->closure->function->maxStack;
+    if (needed > vm.stackCapacity) growStack(needed);
+}
+
+static bool pushFrame() {
+    if (vm.frameCount < vm.frameCapacity) return true;
+    if (vm.frameCount >= vm.maxFrames) return false;
+    int capacity = vm.frameCapacity * 2;
+    if (capacity > vm.maxFrames) capacity = vm.maxFrames;
+    CallFrame* frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) exit(1);
+    vm.frames = frames;
+    vm.frameCapacity = capacity;
+    return true;
+}
+
+int globalSlot(ObjString* name) {
+    // 全局变量第一次被编译器(或注册本地函数时)提到就分配下标,
+    // REPL里后输入的代码沿用同一张表
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJ_VAL(name)); // GC有关
+    int index = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+    pop();
+    return index;
 }
 
+int selectorId(ObjString* name) {
+    // 同上, 方法名第一次被编译器提到就分配选择子,
+    // 类的方法表以选择子为下标, 查方法时不用哈希
+    Value id;
+    if (tableGet(&vm.selectors, name, &id)) return (int)AS_NUMBER(id);
+
+    push(OBJ_VAL(name)); // GC有关
+    int index = vm.selectorNames.count;
+    writeValueArray(&vm.selectorNames, OBJ_VAL(name));
+    tableSet(&vm.selectors, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
+#define SELECTOR_NAME(selector) AS_STRING(vm.selectorNames.values[selector])
+
 void push(Value value) {
+    // 虚拟机外部(注册本地函数, 载入脚本)使用, 需要检查容量;
+    // run()里的PUSH已经由reserveStack保证
+    if (vm.stackTop - vm.stack == vm.stackCapacity) {
+        growStack(vm.stackCapacity + 1);
+    }
     *vm.stackTop = value;
     vm.stackTop++;
 }
@@ -91,7 +278,7 @@ static bool call(ObjClosure* closure, int argCount) {
             argCount);
         return false;
     }
-    if (vm.frameCount == FRAMES_MAX) {
+    if (!pushFrame()) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -99,6 +286,7 @@ static bool call(ObjClosure* closure, int argCount) {
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+    reserveStack(frame);
     return true;
 }
 
@@ -113,9 +301,8 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLASS: {
                 ObjClass* zlass = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(zlass));
-                Value initializer;
-                if (tableGet(&zlass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (zlass->initializer != NULL) {
+                    return call(zlass->initializer, argCount);
                 } else if (argCount != 0) {
                     runtimeError("Expected 0 arguments but got %d.", argCount);
                     return false;
@@ -124,10 +311,19 @@ static bool callValue(Value callee, int argCount) {
             }
             case OBJ_CLOSURE: return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1; // 函数内的槽直接丢弃
-                push(result);                // 放新的
+                ObjNative* native = AS_NATIVE(callee);
+                if (native->arity != NATIVE_VARIADIC
+                    && argCount != native->arity) {
+                    runtimeError(
+                        "Expected %d arguments but got %d.", native->arity,
+                        argCount);
+                    return false;
+                }
+                // 结果已经写在被调用者的槽里, 只需丢弃参数
+                if (!native->function(argCount, vm.stackTop - argCount)) {
+                    return false;
+                }
+                vm.stackTop -= argCount;
                 return true;
             }
             default: break; // Non-callable object type.
@@ -137,16 +333,34 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-static bool invokeFromClass(ObjClass* zlass, ObjString* name, int argCount) {
-    Value method;
-    if (!tableGet(&zlass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+static void
+cacheMethod(InvokeCache* cache, ObjClass* zlass, ObjClosure* method) {
+    if (cache->megamorphic) return;
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].klass == zlass) return;
+    }
+    if (cache->count == INVOKE_CACHE_SIZE) {
+        cache->megamorphic = true;
+        return;
+    }
+    cache->entries[cache->count].klass = zlass;
+    cache->entries[cache->count].method = method;
+    cache->count++;
+}
+
+static bool invokeFromClass(
+    ObjClass* zlass, int selector, int argCount, InvokeCache* cache) {
+    ObjClosure* method = findMethod(zlass, selector);
+    if (method == NULL) {
+        runtimeError(
+            "Undefined property '%s'.", SELECTOR_NAME(selector)->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    if (cache != NULL) cacheMethod(cache, zlass, method);
+    return call(method, argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
+static bool invoke(int selector, int argCount, InvokeCache* cache) {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver)) {
         runtimeError("Only instances have methods.");
@@ -155,7 +369,7 @@ static bool invoke(ObjString* name, int argCount) {
     ObjInstance* instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (getField(instance, SELECTOR_NAME(selector), &value)) {
         // 为什么要这样做, 因为这样的情况, 可以把方法赋值给另一个字段,
         // 此时用户会像调用一个方法一样使用它, 但是这个不是一个方法调用,
         // 而是一个字段访问
@@ -163,17 +377,18 @@ static bool invoke(ObjString* name, int argCount) {
         return callValue(value, argCount);
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    return invokeFromClass(instance->klass, selector, argCount, cache);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+static bool bindMethod(ObjClass* klass, int selector) {
+    ObjClosure* method = findMethod(klass, selector);
+    if (method == NULL) {
+        runtimeError(
+            "Undefined property '%s'.", SELECTOR_NAME(selector)->chars);
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
     return true;
@@ -211,10 +426,13 @@ static void closeUpvalues(Value* last) { // 关闭指定栈槽以上的所有需
     }
 }
 
-static void defineMethod(ObjString* name) {
-    Value method = peek(0);
+static void defineMethod(int selector) {
+    ObjClosure* method = AS_CLOSURE(peek(0));
     ObjClass* klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
+    ObjString* name = SELECTOR_NAME(selector);
+    setMethod(klass, selector, method);
+    if (name == vm.initString) klass->initializer = method;
+    addMethodName(name);
     pop();
 }
 
@@ -223,353 +441,1100 @@ static bool isFalsey(Value value) {
 }
 
 static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString* result = takeString(chars, length);
+    Value result = concatStrings(peek(1), peek(0));
     pop();
     pop();
-    push(OBJ_VAL(result));
+    push(result);
+}
+
+static void flattenOperands() {
+    // 相等比较前把栈顶两个值中的绳子换成拼接后的字符串, valuesEqual
+    // 只比较字符串; 拼接期间它们留在栈上, 不会被GC回收
+    for (Value* slot = vm.stackTop - 2; slot < vm.stackTop; slot++) {
+        if (IS_ROPE(*slot)) *slot = OBJ_VAL(flattenRope(AS_ROPE(*slot)));
+    }
+}
+
+// 数字运算: 两个操作数都是小整数时用64位整数计算, 结果超出int32的范围就
+// 提升为double(两个int32的和与积在double里都是精确的), 否则按double计算
+static inline Value intResult(int64_t result) {
+    return result == (int32_t)result ? INT_VAL((int32_t)result)
+                                     : NUMBER_VAL((double)result);
+}
+
+static inline Value addNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        return intResult((int64_t)AS_INT(a) + AS_INT(b));
+    }
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        return intResult((int64_t)AS_INT(a) - AS_INT(b));
+    }
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiplyNumbers(Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t result = (int64_t)AS_INT(a) * AS_INT(b);
+        // 0乘负数在double里是-0, 整数表示不了, 交给下面按double计算
+        if (result != 0 || (AS_INT(a) >= 0 && AS_INT(b) >= 0)) {
+            return intResult(result);
+        }
+    }
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value divideNumbers(Value a, Value b) {
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)); // 除法总是得到double
+}
+
+#define NUMBER_COMPARE(a, op, b)                     \
+    (IS_INT(a) && IS_INT(b) ? AS_INT(a) op AS_INT(b) \
+                            : AS_NUMBER(a) op AS_NUMBER(b))
+
+static inline Value greaterNumbers(Value a, Value b) {
+    return BOOL_VAL(NUMBER_COMPARE(a, >, b));
+}
+
+static inline Value lessNumbers(Value a, Value b) {
+    return BOOL_VAL(NUMBER_COMPARE(a, <, b));
+}
+
+static inline Value greaterEqualNumbers(Value a, Value b) {
+    return BOOL_VAL(NUMBER_COMPARE(a, >=, b));
+}
+
+static inline Value lessEqualNumbers(Value a, Value b) {
+    return BOOL_VAL(NUMBER_COMPARE(a, <=, b));
+}
+
+static inline int listIndex(Value index) {
+    // 下标通常是小整数, 不用经过double转换
+    return IS_INT(index) ? AS_INT(index) : (int)AS_DOUBLE(index);
+}
+
+static bool add() {
+    if (IS_STRING_OR_ROPE(peek(0)) && IS_STRING_OR_ROPE(peek(1))) {
+        concatenate();
+    } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        Value b = pop();
+        Value a = pop();
+        push(addNumbers(a, b));
+    } else {
+        runtimeError("Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
+typedef enum {
+    ITERATE_NEXT,
+    ITERATE_DONE,
+    ITERATE_ERROR, // 不可迭代
+} IterateResult;
+
+static IterateResult iterate(Value* iterator) {
+    // 迭代协议: iterator[0]是容器, iterator[1]是游标(从0开始, 含义由容器
+    // 决定), 取出下一个元素放入iterator[2]并推进游标;
+    // 新的容器类型在这里加一个分支就可以用于for-in
+    if (IS_LIST(iterator[0])) {
+        return nextListItem(AS_LIST(iterator[0]), &iterator[1], &iterator[2])
+                 ? ITERATE_NEXT
+                 : ITERATE_DONE;
+    }
+    return ITERATE_ERROR;
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame* frame) {
+    printf("          ");
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(
+        &frame->closure->function->chunk,
+        (int)(frame->ip - frame->closure->function->chunk.code));
+}
+#endif
+
 static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    // 当前帧的状态缓存在局部变量里, 编译器可以把它们一直放在寄存器中;
+    // 只在调用、返回、可能触发GC(分配)和报错的地方与frame/vm同步
+    CallFrame* frame;
+    uint8_t* ip;      // frame->ip
+    Value* slots;     // frame->slots
+    Value* constants; // 当前函数的常量表
+    Value* sp;        // vm.stackTop
+    Value tos = NIL_VAL; // 二元运算的右操作数, 开启栈顶缓存时也是缓存的栈顶
+    // 全局变量只在编译时增加, 运行期间数组不会搬家
+    Value* globals = vm.globalValues.values;
+
+#define STORE_FRAME() (frame->ip = ip, vm.stackTop = sp)
+#define LOAD_FRAME()                                                  \
+    do {                                                              \
+        frame = &vm.frames[vm.frameCount - 1];                        \
+        ip = frame->ip;                                               \
+        slots = frame->slots;                                         \
+        constants = frame->closure->function->chunk.constants.values; \
+        sp = vm.stackTop;                                             \
+    } while (false)
+#define LOAD_STACK() (sp = vm.stackTop)
+#define RUNTIME_ERROR(...)              \
+    do {                                \
+        STORE_FRAME();                  \
+        runtimeError(__VA_ARGS__);      \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() \
-    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define PUSH(value) (*sp++ = (value))
+#define POP()       (*--sp)
+#define DROP()      (sp--)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT()) //
-#define BINARY_OP(valueType, op)                          \
-    do {                                                  \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers.");    \
-            return INTERPRET_RUNTIME_ERROR;               \
-        }                                                 \
-        double b = AS_NUMBER(pop());                      \
-        double a = AS_NUMBER(pop());                      \
-        push(valueType(a op b));                          \
+#define READ_CACHE()  (&frame->closure->function->caches[READ_SHORT()])
+#define READ_INVOKE_CACHE() \
+    (&frame->closure->function->invokeCaches[READ_SHORT()])
+
+#ifdef TOS_CACHE
+// 栈顶缓存: 产生结果的热点指令把结果留在tos里(逻辑上位于sp[0]), 如果下一条
+// 指令可以直接从tos取右操作数, 就跳到它的_TOS入口, 省掉一次写栈和读栈
+#define TOS_CASE(op) op_##op##_TOS:
+#define PUSH_TOS(value)                  \
+    {                                    \
+        Value result_ = (value);         \
+        if (tosTable[*ip] != NULL) {     \
+            tos = result_;               \
+            PROFILE_OPCODE();            \
+            goto *tosTable[READ_BYTE()]; \
+        }                                \
+        PUSH(result_);                   \
+    }
+#else
+#define TOS_CASE(op)
+#define PUSH_TOS(value) PUSH(value)
+#endif
+
+// 右操作数已经在tos中, compute是上面的xxxNumbers
+#define BINARY_OP(compute)                              \
+    do {                                                \
+        if (!IS_NUMBER(tos) || !IS_NUMBER(PEEK(0))) {   \
+            PUSH(tos);                                  \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        }                                               \
+        Value a = POP();                                \
+        PUSH_TOS(compute(a, tos));                      \
+    } while (false)
+// 比较并跳转: 右操作数已经在tos中, 比较不成立(包括有NaN时)则跳转
+#define COMPARE_JUMP(op)                                \
+    do {                                                \
+        uint16_t offset = READ_SHORT();                 \
+        if (!IS_NUMBER(tos) || !IS_NUMBER(PEEK(0))) {   \
+            PUSH(tos);                                  \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        }                                               \
+        Value a = POP();                                \
+        if (!NUMBER_COMPARE(a, op, tos)) ip += offset;  \
+    } while (false)
+// 计数循环: 计数器一定是数字(进入循环时比较过, 循环体不会修改它),
+// 上界由readLimit读出, 是局部变量时可能被循环体改成别的类型
+#define FOR_LOOP(readLimit)                                  \
+    do {                                                     \
+        uint8_t counter = READ_BYTE();                       \
+        Value limit = readLimit;                             \
+        Value step = READ_CONSTANT();                        \
+        uint16_t offset = READ_SHORT();                      \
+        Value next = addNumbers(slots[counter], step);       \
+        slots[counter] = next;                               \
+        if (!IS_NUMBER(limit)) {                             \
+            RUNTIME_ERROR("Operands must be numbers.");      \
+        }                                                    \
+        if (NUMBER_COMPARE(next, <, limit)) ip -= offset;    \
+    } while (false)
+// 寄存器形式: slots[a] = slots[b] op c, c是栈槽或常量, 由readC读出
+#define REGISTER_OP(compute, readC)                          \
+    do {                                                     \
+        uint8_t a = READ_BYTE();                             \
+        Value b = slots[READ_BYTE()];                        \
+        Value c = readC;                                     \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                \
+            RUNTIME_ERROR("Operands must be numbers.");      \
+        }                                                    \
+        slots[a] = compute(b, c);                            \
+    } while (false)
+#define REGISTER_ADD(readC)                                     \
+    do {                                                        \
+        uint8_t a = READ_BYTE();                                \
+        Value b = slots[READ_BYTE()];                           \
+        Value c = readC;                                        \
+        if (IS_NUMBER(b) && IS_NUMBER(c)) {                     \
+            slots[a] = addNumbers(b, c);                        \
+        } else {                                                \
+            PUSH(b);                                            \
+            PUSH(c);                                            \
+            STORE_FRAME();                                      \
+            if (!add()) return INTERPRET_RUNTIME_ERROR;         \
+            LOAD_STACK();                                       \
+            slots[a] = POP();                                   \
+        }                                                       \
     } while (false)
-    for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(
-            &frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION() (STORE_FRAME(), traceExecution(frame))
+#else
+#define TRACE_EXECUTION() \
+    do {                  \
+    } while (false)
+#endif
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_OPCODE() profileOpcode(*ip)
+#else
+#define PROFILE_OPCODE() \
+    do {                 \
+    } while (false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_CLOSURE: {
+
+// 快速化(quickening): 通用指令第一次执行后, 按看到的操作数类型把chunk中的
+// 操作码原地改写成特化版本, 特化版本只做一次类型守卫; 守卫失败时改写回
+// 通用版本并重新执行这条指令(length是已经读过的字节数)
+#define QUICKEN_BINARY(numberOp, stringOp)                   \
+    do {                                                     \
+        if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {      \
+            ip[-1] = (numberOp);                             \
+        } else if (IS_STRING_OR_ROPE(PEEK(0))                \
+                   && IS_STRING_OR_ROPE(PEEK(1))) {          \
+            ip[-1] = (stringOp);                             \
+        }                                                    \
+    } while (false)
+// 相等比较的操作数里有绳子时先拼接, 见flattenOperands()
+#define FLATTEN_OPERANDS()                              \
+    do {                                                \
+        if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) {     \
+            STORE_FRAME();                              \
+            flattenOperands();                          \
+        }                                               \
+    } while (false)
+#define DEOPTIMIZE(generic, length) \
+    {                               \
+        ip -= (length);             \
+        *ip = (generic);            \
+        DISPATCH();                 \
+    }
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    // 线程化分派: 每个操作码对应一个处理例程的标签地址, 由OpCode枚举值索引,
+    // 每个处理例程末尾都有自己的间接跳转, 分支预测器可以按"上一条指令"区分
+    static void* dispatchTable[UINT8_COUNT] = {
+        [0 ... UINT8_MAX] = &&op_UNKNOWN,
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_POP] = &&op_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+        [OP_GET_OUTER] = &&op_OP_GET_OUTER,
+        [OP_SET_OUTER] = &&op_OP_SET_OUTER,
+        [OP_SKIP] = &&op_OP_SKIP,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_FALSE_OR_POP] = &&op_OP_JUMP_IF_FALSE_OR_POP,
+        [OP_JUMP_IF_TRUE_OR_POP] = &&op_OP_JUMP_IF_TRUE_OR_POP,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_CLASS] = &&op_OP_CLASS,
+        [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+        [OP_METHOD] = &&op_OP_METHOD,
+        [OP_INVOKE] = &&op_OP_INVOKE,
+        [OP_INHERIT] = &&op_OP_INHERIT,
+        [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+        [OP_BUILD_LIST] = &&op_OP_BUILD_LIST,
+        [OP_INDEX_SUBSCR] = &&op_OP_INDEX_SUBSCR,
+        [OP_STORE_SUBSCR] = &&op_OP_STORE_SUBSCR,
+        [OP_FOR_ITER] = &&op_OP_FOR_ITER,
+        [OP_ADD_LL] = &&op_OP_ADD_LL,
+        [OP_ADD_LC] = &&op_OP_ADD_LC,
+        [OP_SUBTRACT_LL] = &&op_OP_SUBTRACT_LL,
+        [OP_SUBTRACT_LC] = &&op_OP_SUBTRACT_LC,
+        [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+        [OP_JUMP_IF_NOT_LESS] = &&op_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = &&op_OP_JUMP_IF_NOT_LESS_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER] = &&op_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&op_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        [OP_JUMP_IF_NOT_EQUAL] = &&op_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_EQUAL] = &&op_OP_JUMP_IF_EQUAL,
+        [OP_FOR_LOOP] = &&op_OP_FOR_LOOP,
+        [OP_FOR_LOOP_K] = &&op_OP_FOR_LOOP_K,
+        [OP_MOVE] = &&op_OP_MOVE,
+        [OP_LOADK] = &&op_OP_LOADK,
+        [OP_ADD_RRR] = &&op_OP_ADD_RRR,
+        [OP_ADD_RRK] = &&op_OP_ADD_RRK,
+        [OP_SUBTRACT_RRR] = &&op_OP_SUBTRACT_RRR,
+        [OP_SUBTRACT_RRK] = &&op_OP_SUBTRACT_RRK,
+        [OP_MULTIPLY_RRR] = &&op_OP_MULTIPLY_RRR,
+        [OP_MULTIPLY_RRK] = &&op_OP_MULTIPLY_RRK,
+        [OP_DIVIDE_RRR] = &&op_OP_DIVIDE_RRR,
+        [OP_DIVIDE_RRK] = &&op_OP_DIVIDE_RRK,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_ADD_STR] = &&op_OP_ADD_STR,
+        [OP_CALL_CLOSURE] = &&op_OP_CALL_CLOSURE,
+        [OP_GET_FIELD] = &&op_OP_GET_FIELD,
+    };
+#ifdef TOS_CACHE
+    // 能直接从tos取右操作数的指令
+    static void* tosTable[UINT8_COUNT] = {
+        [OP_GREATER] = &&op_OP_GREATER_TOS,
+        [OP_LESS] = &&op_OP_LESS_TOS,
+        [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL_TOS,
+        [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL_TOS,
+        [OP_JUMP_IF_NOT_LESS] = &&op_OP_JUMP_IF_NOT_LESS_TOS,
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = &&op_OP_JUMP_IF_NOT_LESS_EQUAL_TOS,
+        [OP_JUMP_IF_NOT_GREATER] = &&op_OP_JUMP_IF_NOT_GREATER_TOS,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] =
+            &&op_OP_JUMP_IF_NOT_GREATER_EQUAL_TOS,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT_TOS,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY_TOS,
+        [OP_DIVIDE] = &&op_OP_DIVIDE_TOS,
+        [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP_TOS,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM_TOS,
+    };
+#endif
+#define CASE(op) op_##op
+#define DISPATCH()                        \
+    do {                                  \
+        TRACE_EXECUTION();                \
+        PROFILE_OPCODE();                 \
+        goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+
+    DISPATCH();
+#else
+#define CASE(op)   case op
+#define DISPATCH() break
+
+    for (;;) {
+        TRACE_EXECUTION();
+        PROFILE_OPCODE();
+        switch (READ_BYTE()) {
+#endif
+            CASE(OP_CONSTANT): PUSH_TOS(READ_CONSTANT()); DISPATCH();
+            CASE(OP_CLOSURE): {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                STORE_FRAME();
                 ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
+                PUSH(OBJ_VAL(closure));
+                STORE_FRAME(); // captureUpvalue也会分配
                 for (int i = 0; i < closure->upvalueCount; i++) {
                     uint8_t isLocal = READ_BYTE();
                     uint8_t index = READ_BYTE();
                     if (isLocal) { // 在相邻外层
                         closure->upvalues[i] = captureUpvalue(
-                            frame->slots + index); // index是栈相对索引嘛,
-                                                   // slots就是当前的栈指针
+                            slots + index); // index是栈相对索引嘛,
+                                            // slots就是当前的栈指针
                     } else { // 在不相邻外层, 此时外层已经处理好了, 递归下来
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
-                break;
+                DISPATCH();
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+            CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+            CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+            CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+            CASE(OP_POP): DROP(); DISPATCH();
+            CASE(OP_DEFINE_GLOBAL): {
+                globals[READ_SHORT()] = POP();
+                DISPATCH();
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_GET_GLOBAL): {
+                uint16_t slot = READ_SHORT();
+                Value value = globals[slot];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR(
+                        "Undefined variable '%s'.",
+                        AS_STRING(vm.globalNames.values[slot])->chars);
                 }
-                push(value);
-                break;
+                PUSH(value);
+                DISPATCH();
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefine variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_SET_GLOBAL): {
+                uint16_t slot = READ_SHORT();
+                if (IS_UNDEFINED(globals[slot])) {
+                    RUNTIME_ERROR(
+                        "Undefine variable '%s'.",
+                        AS_STRING(vm.globalNames.values[slot])->chars);
                 }
-                break;
+                globals[slot] = PEEK(0);
+                DISPATCH();
             }
-            case OP_GET_LOCAL: {
+            CASE(OP_GET_LOCAL): PUSH_TOS(slots[READ_BYTE()]); DISPATCH();
+            CASE(OP_SET_LOCAL): {
                 uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+                slots[slot] = PEEK(0);
+                DISPATCH();
+            }
+            CASE(OP_GET_UPVALUE): {
+                uint8_t slot = READ_BYTE(); // 参数是在上值列表中的索引
+                PUSH(*frame->closure->upvalues[slot]->location);
+                DISPATCH();
             }
-            case OP_SET_LOCAL: {
+            CASE(OP_SET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+                *frame->closure->upvalues[slot]->location = PEEK(0);
+                DISPATCH();
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE(); // 参数是在上值列表中的索引
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            CASE(OP_GET_OUTER): {
+                // 只被直接调用的局部函数, 调用者就是定义它的那一帧
+                uint8_t slot = READ_BYTE();
+                PUSH(frame[-1].slots[slot]);
+                DISPATCH();
             }
-            case OP_SET_UPVALUE: {
+            CASE(OP_SET_OUTER): {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError(
-                        "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+                frame[-1].slots[slot] = PEEK(0);
+                DISPATCH();
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_SKIP): {
+                uint8_t skip = READ_BYTE();
+                ip += skip;
+                DISPATCH();
+            }
+            CASE(OP_EQUAL): {
+                FLATTEN_OPERANDS();
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(valuesEqual(a, b)));
+                DISPATCH();
+            }
+            CASE(OP_GREATER): tos = POP();
+            TOS_CASE(OP_GREATER) BINARY_OP(greaterNumbers); DISPATCH();
+            CASE(OP_LESS): tos = POP();
+            TOS_CASE(OP_LESS) BINARY_OP(lessNumbers); DISPATCH();
+            CASE(OP_NOT_EQUAL): {
+                FLATTEN_OPERANDS();
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(!valuesEqual(a, b)));
+                DISPATCH();
+            }
+            CASE(OP_GREATER_EQUAL): tos = POP();
+            TOS_CASE(OP_GREATER_EQUAL)
+                BINARY_OP(greaterEqualNumbers); DISPATCH();
+            CASE(OP_LESS_EQUAL): tos = POP();
+            TOS_CASE(OP_LESS_EQUAL) BINARY_OP(lessEqualNumbers); DISPATCH();
+            CASE(OP_ADD): {
+                QUICKEN_BINARY(OP_ADD_NUM, OP_ADD_STR);
+                STORE_FRAME();
+                if (!add()) return INTERPRET_RUNTIME_ERROR;
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT): tos = POP();
+            TOS_CASE(OP_SUBTRACT) BINARY_OP(subtractNumbers); DISPATCH();
+            CASE(OP_MULTIPLY): tos = POP();
+            TOS_CASE(OP_MULTIPLY) BINARY_OP(multiplyNumbers); DISPATCH();
+            CASE(OP_DIVIDE): tos = POP();
+            TOS_CASE(OP_DIVIDE) BINARY_OP(divideNumbers); DISPATCH();
+            CASE(OP_NOT): PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))); DISPATCH();
+            CASE(OP_NEGATE):
+                if (!IS_NUMBER(PEEK(0))) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                // 0取反是-0, INT32_MIN取反会溢出, 这两种交给double
+                if (IS_INT(PEEK(0)) && AS_INT(PEEK(0)) != 0
+                    && AS_INT(PEEK(0)) != INT32_MIN) {
+                    PEEK(0) = INT_VAL(-AS_INT(PEEK(0)));
+                } else {
+                    PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                printValue(pop());
+                DISPATCH();
+            CASE(OP_PRINT): {
+                printValue(POP());
                 printf("\n");
-                break;
+                DISPATCH();
+            }
+            CASE(OP_JUMP): {
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                DISPATCH();
             }
-            case OP_JUMP: {
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                if (isFalsey(PEEK(0))) ip += offset; // condition is false, jump
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_POP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0)))
-                    frame->ip += offset; // condition is false, jump
-                break;
+                if (isFalsey(POP())) ip += offset;
+                DISPATCH();
             }
-            case OP_LOOP: {
+            CASE(OP_JUMP_IF_FALSE_OR_POP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                if (isFalsey(PEEK(0))) {
+                    ip += offset;
+                } else {
+                    DROP();
+                }
+                DISPATCH();
             }
-            case OP_CALL: {
+            CASE(OP_JUMP_IF_TRUE_OR_POP): {
+                uint16_t offset = READ_SHORT();
+                if (!isFalsey(PEEK(0))) {
+                    ip += offset;
+                } else {
+                    DROP();
+                }
+                DISPATCH();
+            }
+            CASE(OP_LOOP): {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                DISPATCH();
+            }
+            CASE(OP_CALL): {
                 int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
+                if (IS_CLOSURE(PEEK(argCount))) ip[-2] = OP_CALL_CLOSURE;
+                STORE_FRAME();
+                if (!callValue(PEEK(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            CASE(OP_TAIL_CALL): {
+                int argCount = READ_BYTE();
+                Value callee = PEEK(argCount);
+                if (!IS_CLOSURE(callee)) {
+                    // 本地函数和类的调用不会加深调用栈, 按普通调用处理
+                    STORE_FRAME();
+                    if (!callValue(callee, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+                ObjClosure* closure = AS_CLOSURE(callee);
+                if (argCount != closure->function->arity) {
+                    RUNTIME_ERROR(
+                        "Expected %d arguments but got %d.",
+                        closure->function->arity, argCount);
+                }
+                // 当前帧到此结束: 关闭它的上值, 把被调用者和参数
+                // 向下移动到它的栈槽上, 然后在同一个CallFrame里执行
+                closeUpvalues(slots);
+                Value* callSlots = sp - argCount - 1;
+                for (int i = 0; i <= argCount; i++) slots[i] = callSlots[i];
+                vm.stackTop = slots + argCount + 1;
+                frame->closure = closure;
+                frame->ip = closure->function->chunk.code;
+                reserveStack(frame);
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
+            CASE(OP_CLOSE_UPVALUE): {
+                closeUpvalues(sp - 1);
+                DROP();
+                DISPATCH();
+            }
+            CASE(OP_RETURN): {
+                Value result = POP();
+                closeUpvalues(slots);
                 vm.frameCount--;
                 if (vm.frameCount == 0) {
-                    pop();
+                    DROP();
+                    vm.stackTop = sp;
                     return INTERPRET_OK;
                 }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                vm.stackTop = slots;
+                LOAD_FRAME();
+                PUSH(result);
+                DISPATCH();
             }
-            case OP_CLASS: push(OBJ_VAL(newClass(READ_STRING()))); break;
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) { // check, avoid get any name
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_CLASS): {
+                ObjString* name = READ_STRING();
+                STORE_FRAME();
+                PUSH(OBJ_VAL(newClass(name)));
+                DISPATCH();
+            }
+            CASE(OP_GET_PROPERTY): {
+                if (!IS_INSTANCE(PEEK(0))) { // check, avoid get any name
+                    RUNTIME_ERROR("Only instances have properties.");
                 }
 
-                ObjInstance* instance = AS_INSTANCE(peek(0));
+                ObjInstance* instance = AS_INSTANCE(PEEK(0));
                 ObjString* name = READ_STRING();
+                PropertyCache* cache = READ_CACHE();
+
+                if (cache->shape == instance->shape) {
+                    if (cache->slot != -1) {
+                        CACHE_HIT(getPropertyStats);
+                        PEEK(0) = instance->fields[cache->slot];
+                        DISPATCH();
+                    }
+                    // 形状相同说明没有同名字段遮住方法
+                    if (cache->klass == instance->klass) {
+                        CACHE_HIT(getPropertyStats);
+                        STORE_FRAME();
+                        ObjBoundMethod* bound =
+                            newBoundMethod(PEEK(0), cache->method);
+                        PEEK(0) = OBJ_VAL(bound);
+                        DISPATCH();
+                    }
+                }
 
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
+                CACHE_MISS(getPropertyStats);
+                int slot = shapeSlot(instance->shape, name);
+                if (slot != -1) {
+                    cache->shape = instance->shape;
+                    cache->slot = slot;
+                    ip[-4] = OP_GET_FIELD;
+                    PEEK(0) = instance->fields[slot]; // 替换掉实例
+                    DISPATCH();
                 }
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                // 属性名不一定是方法名, 缓存未命中时才按名字查选择子
+                Value selector;
+                ObjClosure* method = NULL;
+                if (tableGet(&vm.selectors, name, &selector)) {
+                    method =
+                        findMethod(instance->klass, (int)AS_NUMBER(selector));
                 }
-                break;
-                runtimeError("Undefined property '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
+                if (method == NULL) {
+                    RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+                }
+                cache->shape = instance->shape;
+                cache->slot = -1;
+                cache->klass = instance->klass;
+                cache->method = method;
+                STORE_FRAME();
+                ObjBoundMethod* bound = newBoundMethod(PEEK(0), method);
+                PEEK(0) = OBJ_VAL(bound);
+                DISPATCH();
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) { // 同上
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_SET_PROPERTY): {
+                if (!IS_INSTANCE(PEEK(1))) { // 同上
+                    RUNTIME_ERROR("Only instances have fields.");
+                }
+                ObjInstance* instance = AS_INSTANCE(PEEK(1));
+                ObjString* name = READ_STRING();
+                PropertyCache* cache = READ_CACHE();
+
+                // 命中时要么字段已存在, 要么沿着缓存的迁移加入新字段
+                if (cache->shape == instance->shape) {
+                    CACHE_HIT(setPropertyStats);
+                    if (cache->slot >= instance->capacity) {
+                        STORE_FRAME();
+                        reserveFields(instance, cache->slot + 1);
+                    }
+                    instance->shape = cache->next;
+                    instance->fields[cache->slot] = PEEK(0);
+                } else {
+                    CACHE_MISS(setPropertyStats);
+                    ObjShape* shape = instance->shape;
+                    STORE_FRAME();
+                    int slot = setField(instance, name, PEEK(0));
+                    cache->shape = shape;
+                    cache->next = instance->shape;
+                    cache->slot = slot;
                 }
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+                Value value = POP();
+                PEEK(0) = value; // 替换掉实例
+                DISPATCH();
             }
-            case OP_METHOD: defineMethod(READ_STRING()); break;
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
+            CASE(OP_METHOD): {
+                int selector = READ_SHORT();
+                STORE_FRAME();
+                defineMethod(selector);
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_INVOKE): {
+                int selector = READ_SHORT();
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                InvokeCache* cache = READ_INVOKE_CACHE();
+                Value receiver = PEEK(argCount);
+                // 形状里没有和方法同名的字段时, 方法只取决于接收者的类.
+                // (switch分派时DISPATCH是break, 所以不能在循环里分派)
+                ObjClosure* cached = NULL;
+                if (!cache->megamorphic && IS_INSTANCE(receiver)
+                    && !AS_INSTANCE(receiver)->shape->shadowsMethod) {
+                    ObjClass* klass = AS_INSTANCE(receiver)->klass;
+                    for (int i = 0; i < cache->count; i++) {
+                        if (cache->entries[i].klass == klass) {
+                            cached = cache->entries[i].method;
+                            break;
+                        }
+                    }
+                }
+                STORE_FRAME();
+                if (cached != NULL) {
+                    CACHE_HIT(invokeStats);
+                    if (!call(cached, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+                CACHE_MISS(invokeStats);
+                if (!invoke(selector, argCount, cache)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                LOAD_FRAME();
+                DISPATCH();
             }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
+            CASE(OP_INHERIT): {
+                Value superclass = PEEK(1);
                 if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
+                ObjClass* subclass = AS_CLASS(PEEK(0));
+                STORE_FRAME();
+                inheritMethods(subclass, AS_CLASS(superclass));
+                subclass->initializer = AS_CLASS(superclass)->initializer;
+                subclass->fieldCount = AS_CLASS(superclass)->fieldCount;
+                DROP(); // Subclass.
+                DISPATCH();
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
+            CASE(OP_GET_SUPER): {
+                int selector = READ_SHORT();
+                ObjClass* superclass = AS_CLASS(POP());
 
-                if (!bindMethod(superclass, name)) {
+                STORE_FRAME();
+                if (!bindMethod(superclass, selector)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_SUPER_INVOKE): {
+                int selector = READ_SHORT();
+                int argCount = READ_BYTE();
+                InvokeCache* cache = READ_INVOKE_CACHE();
+                ObjClass* superclass = AS_CLASS(POP());
+                // 超类方法不会被字段遮住, 只按超类缓存
+                ObjClosure* cached = NULL;
+                for (int i = 0; i < cache->count; i++) {
+                    if (cache->entries[i].klass == superclass) {
+                        cached = cache->entries[i].method;
+                        break;
+                    }
+                }
+                STORE_FRAME();
+                if (cached != NULL) {
+                    CACHE_HIT(superInvokeStats);
+                    if (!call(cached, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                } else {
+                    CACHE_MISS(superInvokeStats);
+                    if (!invokeFromClass(
+                            superclass, selector, argCount, cache)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                }
+                LOAD_FRAME();
+                DISPATCH();
             }
 
-            case OP_BUILD_LIST: {
+            CASE(OP_BUILD_LIST): {
                 // Stack before: [item1, item2, ..., itemN] and after: [list]
+                STORE_FRAME();
                 ObjList* list = newList();
                 uint8_t itemCount = READ_BYTE();
 
                 // Add items to list
                 // So list isn't sweeped by GC in appendToList
-                push(OBJ_VAL(list));
+                PUSH(OBJ_VAL(list));
+                STORE_FRAME();
                 for (int i = itemCount; i > 0; i--) {
-                    appendToList(list, peek(i));
+                    appendToList(list, PEEK(i));
                 }
-                pop();
+                DROP();
 
                 // Pop items from stack
-                while (itemCount-- > 0) { pop(); }
+                sp -= itemCount;
 
-                push(OBJ_VAL(list));
-                break;
+                PUSH(OBJ_VAL(list));
+                DISPATCH();
             }
-            case OP_INDEX_SUBSCR: {
+            CASE(OP_INDEX_SUBSCR): {
                 // Stack before: [list, index] and after: [index(list, index)]
-                Value index = pop();
-                Value list = pop();
+                Value index = POP();
+                Value list = POP();
                 Value result;
 
                 if (!IS_LIST(list)) {
-                    runtimeError("Invalid type to index into.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Invalid type to index into.");
                 }
                 ObjList* list_ = AS_LIST(list);
 
                 if (!IS_NUMBER(index)) {
-                    runtimeError("List index is not a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("List index is not a number.");
                 }
-                int index_ = AS_NUMBER(index);
+                int index_ = listIndex(index);
 
                 if (!isValidListIndex(list_, index_)) {
-                    runtimeError("List index out of range.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("List index out of range.");
                 }
 
                 result = indexFromList(list_, index_);
-                push(result);
-                break;
+                PUSH(result);
+                DISPATCH();
             }
-            case OP_STORE_SUBSCR: {
+            CASE(OP_STORE_SUBSCR): {
                 // Stack before: [list, index, item] and after: [item]
-                Value item = pop();
-                Value index = pop();
-                Value list = pop();
+                Value item = POP();
+                Value index = POP();
+                Value list = POP();
 
                 if (!IS_LIST(list)) {
-                    runtimeError("Cannot store value in a non-list.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Cannot store value in a non-list.");
                 }
                 ObjList* list_ = AS_LIST(list);
 
                 if (!IS_NUMBER(index)) {
-                    runtimeError("List index is not a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("List index is not a number.");
                 }
-                int index_ = AS_NUMBER(index);
+                int index_ = listIndex(index);
 
                 if (!isValidListIndex(list_, index_)) {
-                    runtimeError("Invalid list index.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Invalid list index.");
                 }
 
                 storeToList(list_, index_, item);
-                push(item);
-                break;
+                PUSH(item);
+                DISPATCH();
+            }
+            CASE(OP_FOR_ITER): {
+                Value* iterator = &slots[READ_BYTE()];
+                uint16_t offset = READ_SHORT();
+                switch (iterate(iterator)) {
+                    case ITERATE_NEXT: break;
+                    case ITERATE_DONE: ip += offset; break;
+                    case ITERATE_ERROR:
+                        RUNTIME_ERROR("Can only iterate over lists.");
+                }
+                DISPATCH();
+            }
+
+            CASE(OP_ADD_LL): {
+                Value a = slots[READ_BYTE()];
+                Value b = slots[READ_BYTE()];
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    PUSH_TOS(addNumbers(a, b));
+                    DISPATCH();
+                }
+                PUSH(a);
+                PUSH(b);
+                STORE_FRAME();
+                if (!add()) return INTERPRET_RUNTIME_ERROR;
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_ADD_LC): {
+                Value a = slots[READ_BYTE()];
+                Value b = READ_CONSTANT();
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    PUSH_TOS(addNumbers(a, b));
+                    DISPATCH();
+                }
+                PUSH(a);
+                PUSH(b);
+                STORE_FRAME();
+                if (!add()) return INTERPRET_RUNTIME_ERROR;
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT_LL): {
+                Value a = slots[READ_BYTE()];
+                Value b = slots[READ_BYTE()];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                PUSH_TOS(subtractNumbers(a, b));
+                DISPATCH();
+            }
+            CASE(OP_SUBTRACT_LC): {
+                Value a = slots[READ_BYTE()];
+                Value b = READ_CONSTANT();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                PUSH_TOS(subtractNumbers(a, b));
+                DISPATCH();
+            }
+            CASE(OP_SET_LOCAL_POP): tos = POP();
+            TOS_CASE(OP_SET_LOCAL_POP) slots[READ_BYTE()] = tos; DISPATCH();
+            CASE(OP_JUMP_IF_NOT_LESS): tos = POP();
+            TOS_CASE(OP_JUMP_IF_NOT_LESS) COMPARE_JUMP(<); DISPATCH();
+            CASE(OP_JUMP_IF_NOT_LESS_EQUAL): tos = POP();
+            TOS_CASE(OP_JUMP_IF_NOT_LESS_EQUAL) COMPARE_JUMP(<=); DISPATCH();
+            CASE(OP_JUMP_IF_NOT_GREATER): tos = POP();
+            TOS_CASE(OP_JUMP_IF_NOT_GREATER) COMPARE_JUMP(>); DISPATCH();
+            CASE(OP_JUMP_IF_NOT_GREATER_EQUAL): tos = POP();
+            TOS_CASE(OP_JUMP_IF_NOT_GREATER_EQUAL) COMPARE_JUMP(>=); DISPATCH();
+            CASE(OP_JUMP_IF_NOT_EQUAL): {
+                uint16_t offset = READ_SHORT();
+                FLATTEN_OPERANDS();
+                Value b = POP();
+                Value a = POP();
+                if (!valuesEqual(a, b)) ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_EQUAL): {
+                uint16_t offset = READ_SHORT();
+                FLATTEN_OPERANDS();
+                Value b = POP();
+                Value a = POP();
+                if (valuesEqual(a, b)) ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_FOR_LOOP): FOR_LOOP(slots[READ_BYTE()]); DISPATCH();
+            CASE(OP_FOR_LOOP_K): FOR_LOOP(READ_CONSTANT()); DISPATCH();
+
+            CASE(OP_MOVE): {
+                uint8_t a = READ_BYTE();
+                slots[a] = slots[READ_BYTE()];
+                DISPATCH();
+            }
+            CASE(OP_LOADK): {
+                uint8_t a = READ_BYTE();
+                slots[a] = READ_CONSTANT();
+                DISPATCH();
             }
+            CASE(OP_ADD_RRR): REGISTER_ADD(slots[READ_BYTE()]); DISPATCH();
+            CASE(OP_ADD_RRK): REGISTER_ADD(READ_CONSTANT()); DISPATCH();
+            CASE(OP_SUBTRACT_RRR):
+                REGISTER_OP(subtractNumbers, slots[READ_BYTE()]);
+                DISPATCH();
+            CASE(OP_SUBTRACT_RRK):
+                REGISTER_OP(subtractNumbers, READ_CONSTANT());
+                DISPATCH();
+            CASE(OP_MULTIPLY_RRR):
+                REGISTER_OP(multiplyNumbers, slots[READ_BYTE()]);
+                DISPATCH();
+            CASE(OP_MULTIPLY_RRK):
+                REGISTER_OP(multiplyNumbers, READ_CONSTANT());
+                DISPATCH();
+            CASE(OP_DIVIDE_RRR):
+                REGISTER_OP(divideNumbers, slots[READ_BYTE()]);
+                DISPATCH();
+            CASE(OP_DIVIDE_RRK):
+                REGISTER_OP(divideNumbers, READ_CONSTANT());
+                DISPATCH();
+
+            CASE(OP_ADD_NUM): tos = POP();
+            TOS_CASE(OP_ADD_NUM) {
+                if (!IS_NUMBER(tos) || !IS_NUMBER(PEEK(0))) {
+                    PUSH(tos);
+                    DEOPTIMIZE(OP_ADD, 1);
+                }
+                Value a = POP();
+                PUSH_TOS(addNumbers(a, tos));
+                DISPATCH();
+            }
+            CASE(OP_ADD_STR): {
+                if (!IS_STRING_OR_ROPE(PEEK(0))
+                    || !IS_STRING_OR_ROPE(PEEK(1))) {
+                    DEOPTIMIZE(OP_ADD, 1);
+                }
+                STORE_FRAME();
+                concatenate();
+                LOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_CALL_CLOSURE): {
+                int argCount = READ_BYTE();
+                if (!IS_CLOSURE(PEEK(argCount))) DEOPTIMIZE(OP_CALL, 2);
+                STORE_FRAME();
+                if (!call(AS_CLOSURE(PEEK(argCount)), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(OP_GET_FIELD): {
+                ip++; // 属性名, 只在未命中时需要
+                PropertyCache* cache = READ_CACHE();
+                if (!IS_INSTANCE(PEEK(0))
+                    || AS_INSTANCE(PEEK(0))->shape != cache->shape) {
+                    DEOPTIMIZE(OP_GET_PROPERTY, 4);
+                }
+                CACHE_HIT(getPropertyStats);
+                PEEK(0) = AS_INSTANCE(PEEK(0))->fields[cache->slot];
+                DISPATCH();
+            }
+
+#ifdef COMPUTED_GOTO
+            op_UNKNOWN:
+#else
+            default:
+#endif
+                RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+#ifndef COMPUTED_GOTO
         }
     }
+#endif
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef LOAD_STACK
+#undef RUNTIME_ERROR
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef TOS_CASE
+#undef PUSH_TOS
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef FOR_LOOP
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef QUICKEN_BINARY
+#undef FLATTEN_OPERANDS
+#undef DEOPTIMIZE
+#undef TRACE_EXECUTION
+#undef PROFILE_OPCODE
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char* source) {
@@ -6,8 +6,10 @@
 #include "value.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX  (FRAMES_MAX * UINT8_COUNT)
+// 值栈和调用栈都在堆上, 按需倍增; 调用深度超过上限时报Stack overflow
+#define FRAMES_MAX     65536 // 默认的调用深度上限
+#define FRAMES_INITIAL 8     // 调用栈的初始容量
+#define STACK_INITIAL  64    // 值栈的初始容量(栈槽数)
 
 typedef struct {
     ObjClosure* closure;
@@ -18,14 +20,29 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-    CallFrame
-        frames[FRAMES_MAX]; // 调用栈, 每层栈都有独立的字节码、常量池和调用栈
+    int stackSlots; // 值栈的初始容量
+    int frames;     // 调用栈的初始容量
+    int maxFrames;  // 调用深度上限
+} VMConfig;
+
+typedef struct {
+    CallFrame* frames; // 调用栈, 每层栈都有独立的字节码、常量池和调用栈
     int frameCount;
-    Value stack[STACK_MAX];   // 运行时栈
+    int frameCapacity;
+    int maxFrames;
+    Value* stack;             // 运行时栈, 扩容时会搬家,
+                              // 指向它的指针(slots, 上值)要随之修正
     Value* stackTop;          // 栈顶指针
-    Table globals;            // 全局变量
+    int stackCapacity;
+    Table globalSlots;        // 全局变量名 -> 下标, 编译时分配
+    ValueArray globalValues;  // 全局变量的值, 还没定义的是UNDEFINED_VAL
+    ValueArray globalNames;   // 下标 -> 全局变量名, 报错用
     Table strings;            // 字符串驻留
+    Table methodNames;        // 所有类定义过的方法名, 见ObjShape.shadowsMethod
+    Table selectors;          // 方法名 -> 选择子, 编译时分配, 从0开始连续
+    ValueArray selectorNames; // 选择子 -> 方法名
     ObjString* initString;    // 即字符串"init"
+    ObjShape* rootShape;      // 没有字段的形状, 新实例都从这里开始
     ObjUpvalue* openUpvalues; //
     Obj* objects;             // 不定内存(链表)
 
@@ -46,10 +63,14 @@ typedef enum {
 
 extern VM vm;
 
-void initVM();
+void initVM(const VMConfig* config); // config为NULL时使用默认值
 void freeVM();
 InterpretResult interpret(const char* source);
 
+void runtimeError(const char* format, ...); // 打印错误和调用栈, 并清空栈
+int globalSlot(ObjString* name);
+int selectorId(ObjString* name);
+
 void push(Value value);
 Value pop();
 
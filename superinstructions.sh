@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# 根据训练运行得到的opcode pair统计, 报告哪些指令序列值得合并成超级指令
+#
+# 1. 在src/common.h中打开DEBUG_PROFILE_OPCODES后编译
+# 2. 用有代表性的脚本训练: ./z train.lox 2> profile.txt
+#    (虚拟机退出时向stderr输出"== opcode pairs =="及每行"前 后 次数",
+#    前一条转移控制时行末多一个transfer)
+# 3. ./superinstructions.sh profile.txt [阈值, 占全部分派的百分比, 默认1]
+#
+# 合并一对指令, 每次执行省下一次分派, 所以收益约等于这一对出现的次数.
+# 无条件跳转、调用、返回改变了控制流, 不能和后面的指令合并.
+# 已经合并掉的序列不会再出现在统计里, 报告的是剩下的机会.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 profile.txt [threshold%]" >&2
+    exit 64
+fi
+
+awk -v threshold="${2:-1}" '
+    /^== opcode pairs ==$/ { inProfile = 1; next }
+    inProfile && NF >= 3 && $1 ~ /^OP_/ && $2 ~ /^OP_/ {
+        count[$1 " " $2] = $3
+        total += $3
+        # 前一条指令转移控制(见chunk.c transfersControl)时虚拟机标上transfer
+        if ($4 == "transfer") controlFlow[$1 " " $2] = 1
+    }
+    END {
+        if (total == 0) {
+            print "no opcode pairs found, build with DEBUG_PROFILE_OPCODES" > "/dev/stderr"
+            exit 1
+        }
+        printf "%-40s %12s %8s\n", "pair", "count", "share"
+        n = 0
+        for (pair in count) order[++n] = pair
+        # 按次数降序(插入排序, 条目不多)
+        for (i = 2; i <= n; i++) {
+            key = order[i]
+            for (j = i - 1; j >= 1 && count[order[j]] < count[key]; j--) {
+                order[j + 1] = order[j]
+            }
+            order[j + 1] = key
+        }
+        for (i = 1; i <= n; i++) {
+            pair = order[i]
+            share = 100.0 * count[pair] / total
+            if (share < threshold) break
+            note = controlFlow[pair] ? "  (control flow, skip)" : ""
+            printf "%-40s %12d %7.2f%%%s\n", pair, count[pair], share, note
+        }
+        printf "total dispatches: %d\n", total
+    }
+' "$1"